@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h> // malloc, free, NULL
+#include <string.h> // memcpy, memcmp, memset, strlen
+#include <ctype.h> // isalnum, isdigit
+#include <math.h> // pow
+#include <time.h> // clock
+
+#include <ugly/hash.h> // fnv_1a
+
+#include "common.h" // FAST_STRING_HASH
+#include "table.h" // table_hash
+
+/* Compares table_hash() against plain FNV-1a, in terms of throughput for
+different string lengths and collisions on a few key sets. Identifiers found in
+the Lox scripts given as arguments make up an extra key set. */
+
+typedef hash_t (*HashFn)(const void* ptr, size_t n);
+
+static hash_t fnv(const void* ptr, size_t n)
+{
+	return (uint32_t)fnv_1a(ptr, n);
+}
+
+static const struct {
+	const char* name;
+	HashFn hash;
+} hashes[] = {
+	{ "fnv_1a", fnv },
+#if FAST_STRING_HASH
+	{ "table_hash", table_hash },
+#endif
+};
+
+#define HASH_COUNT (sizeof(hashes) / sizeof(hashes[0]))
+
+typedef struct {
+	char** keys;
+	size_t count;
+	size_t capacity;
+} KeySet;
+
+static void keys_add(KeySet* set, const char* str, size_t n)
+{
+	if (set->count >= set->capacity) {
+		set->capacity = set->capacity > 0 ? set->capacity * 2 : 64;
+		set->keys = realloc(set->keys, set->capacity * sizeof(char*));
+		if (set->keys == NULL) exit(1);
+	}
+	char* key = malloc(n + 1);
+	if (key == NULL) exit(1);
+	memcpy(key, str, n);
+	key[n] = '\0';
+	set->keys[set->count++] = key;
+}
+
+static void keys_destroy(KeySet* set)
+{
+	for (size_t i = 0; i < set->count; ++i)
+		free(set->keys[i]);
+	free(set->keys);
+	*set = (KeySet){0};
+}
+
+// Adds every distinct identifier in the file at PATH to SET.
+static void keys_from_file(KeySet* set, const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return;
+	}
+
+	char word[256];
+	size_t n = 0;
+	for (int c = fgetc(file);; c = fgetc(file)) {
+		if (c != EOF && (isalnum(c) || c == '_') && (n > 0 || !isdigit(c))) {
+			if (n < sizeof(word)) word[n++] = (char)c;
+			continue;
+		} else if (n > 0) {
+			bool seen = false;
+			for (size_t i = 0; i < set->count && !seen; ++i)
+				seen = strlen(set->keys[i]) == n && memcmp(set->keys[i], word, n) == 0;
+			if (!seen) keys_add(set, word, n);
+			n = 0;
+		}
+		if (c == EOF) break;
+	}
+
+	fclose(file);
+}
+
+static int compare_hashes(const void* a, const void* b)
+{
+	const hash_t x = *(const hash_t*)a, y = *(const hash_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Reports full-width duplicates and bucket collisions in a half-full power-of-two table.
+static void report_collisions(const char* title, const KeySet* set)
+{
+	size_t buckets = 1;
+	while (buckets < 2 * set->count) buckets *= 2;
+	const double expected = set->count - buckets * (1.0 - pow(1.0 - 1.0 / buckets, set->count));
+
+	printf("%s: %zu keys, %zu buckets, ~%.1f bucket collisions expected\n",
+	       title, set->count, buckets, expected);
+
+	hash_t* values = malloc(set->count * sizeof(hash_t));
+	unsigned char* used = malloc(buckets);
+	if (values == NULL || used == NULL) exit(1);
+
+	for (size_t h = 0; h < HASH_COUNT; ++h) {
+		memset(used, 0, buckets);
+		size_t collisions = 0;
+		for (size_t i = 0; i < set->count; ++i) {
+			values[i] = hashes[h].hash(set->keys[i], strlen(set->keys[i]));
+			const size_t bucket = values[i] & (buckets - 1);
+			collisions += used[bucket];
+			used[bucket] = 1;
+		}
+
+		qsort(values, set->count, sizeof(hash_t), compare_hashes);
+		size_t duplicates = 0;
+		for (size_t i = 1; i < set->count; ++i)
+			duplicates += values[i] == values[i - 1];
+
+		printf("  %-10s %8zu bucket collisions %8zu duplicate hashes\n",
+		       hashes[h].name, collisions, duplicates);
+	}
+
+	free(used);
+	free(values);
+}
+
+static void report_throughput(void)
+{
+	static const size_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024, 4096, 65536 };
+	const size_t max_length = lengths[sizeof(lengths) / sizeof(lengths[0]) - 1];
+	const size_t total = 64 * 1024 * 1024; // bytes hashed per measurement
+
+	const size_t offsets = 1024; // varying the input defeats hoisting out of the loop
+	unsigned char* data = malloc(max_length + offsets);
+	if (data == NULL) exit(1);
+	for (size_t i = 0; i < max_length + offsets; ++i)
+		data[i] = (unsigned char)(i * 131 + 7);
+
+	printf("throughput (MiB/s):\n  %-8s", "length");
+	for (size_t h = 0; h < HASH_COUNT; ++h)
+		printf(" %12s", hashes[h].name);
+	printf("\n");
+
+	volatile hash_t sink = 0;
+	for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+		const size_t n = lengths[l];
+		const size_t rounds = total / n;
+		printf("  %-8zu", n);
+		for (size_t h = 0; h < HASH_COUNT; ++h) {
+			const clock_t start = clock();
+			for (size_t r = 0; r < rounds; ++r)
+				sink ^= hashes[h].hash(data + r % offsets, n);
+			const double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+			printf(" %12.1f", seconds > 0 ? (rounds * n) / seconds / (1024 * 1024) : 0.0);
+		}
+		printf("\n");
+	}
+	(void)sink;
+
+	free(data);
+}
+
+int main(int argc, const char* argv[])
+{
+	report_throughput();
+
+	char buffer[64];
+	KeySet set = {0};
+
+	for (int i = 0; i < 100000; ++i)
+		keys_add(&set, buffer, snprintf(buffer, sizeof(buffer), "key%d", i));
+	report_collisions("sequential keys", &set);
+	keys_destroy(&set);
+
+	for (int i = 0; i < 100000; ++i)
+		keys_add(&set, buffer, snprintf(buffer, sizeof(buffer), "%08x", i * 4096));
+	report_collisions("hex numbers", &set);
+	keys_destroy(&set);
+
+	for (int i = 0; i < 20000; ++i)
+		keys_add(&set, buffer, snprintf(buffer, sizeof(buffer),
+		         "{\"id\": %d, \"name\": \"user%d\", \"active\": true}", i, i % 97));
+	report_collisions("json lines", &set);
+	keys_destroy(&set);
+
+	for (int i = 1; i < argc; ++i)
+		keys_from_file(&set, argv[i]);
+	if (set.count > 0)
+		report_collisions("script identifiers", &set);
+	keys_destroy(&set);
+
+	return 0;
+}
@@ -1,6 +1,15 @@
+#define _POSIX_C_SOURCE 200809L // mmap, posix_madvise, fstat, sysconf
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
 #include <stdio.h>
 #include <stdlib.h> // malloc, free, NULL
 #include <errno.h>
+#ifdef __unix__
+#	include <fcntl.h> // open
+#	include <unistd.h> // close, sysconf
+#	include <sys/mman.h> // mmap, munmap, posix_madvise
+#	include <sys/stat.h> // fstat
+#endif
 
 #include "vm.h"
 
@@ -56,15 +65,78 @@ static char* read_file(const char* path)
 	return buffer;
 }
 
+#ifdef __unix__
+/** Maps the file at PATH into memory, read-only, setting the SIZE of the whole
+ * mapping. The file goes over a mapping of zeros a page longer than it, so the
+ * text is null-terminated without a copy, even when it fills its last page.
+ * When the file isn't a regular one, or can't be mapped, this returns NULL. */
+static char* map_file(const char* path, size_t* size)
+{
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	char* text = NULL;
+	struct stat info;
+	const long page = sysconf(_SC_PAGESIZE);
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && page > 0) {
+		// past the end of the file, its last page is zero-filled, then comes a page of zeros
+		const size_t length = (size_t)info.st_size;
+		const size_t pages = (length + (size_t)page - 1) / (size_t)page + 1;
+		const size_t guarded = pages * (size_t)page;
+		char* zeros = mmap(NULL, guarded, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (zeros != MAP_FAILED) {
+			if (mmap(zeros, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+				posix_madvise(zeros, length, POSIX_MADV_SEQUENTIAL); // the scanner reads it just once
+				text = zeros;
+				*size = guarded;
+			} else {
+				munmap(zeros, guarded);
+			}
+		}
+	}
+
+	close(fd); // the mapping stays valid
+	return text;
+}
+#endif
+
+// Script source, along with the size of its mapping when it wasn't read into a buffer.
+typedef struct {
+	char* text;
+	size_t mapped;
+} Source;
+
+// Loads the file at PATH, preferably by mapping it, so that big scripts aren't copied.
+static Source load_source(const char* path)
+{
+#ifdef __unix__
+	size_t size;
+	char* text = map_file(path, &size);
+	if (text != NULL) return (Source){ text, size };
+#endif
+	return (Source){ read_file(path), 0 };
+}
+
+static void unload_source(Source source)
+{
+#ifdef __unix__
+	if (source.mapped > 0) {
+		munmap(source.text, source.mapped);
+		return;
+	}
+#endif
+	free(source.text);
+}
+
 static int run_file(const char* filename)
 {
 	VM vm;
 	vm_init(&vm);
-	char* source = read_file(filename);
+	const Source source = load_source(filename);
 
-	const InterpretResult result = vm_interpret(&vm, source);
+	const InterpretResult result = vm_interpret(&vm, source.text);
 
-	free(source);
+	unload_source(source);
 	vm_destroy(&vm);
 
 	if (result == INTERPRET_COMPILE_ERROR) return 65;
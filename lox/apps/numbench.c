@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h> // malloc, free, strtod
+#include <string.h> // memcmp, strlen
+#include <time.h> // clock
+
+#include "common.h" // uint64_t
+#include "number.h" // number_format, number_parse
+
+/* Compares number_format() and number_parse() against snprintf() and strtod(),
+in terms of throughput on a few kinds of numbers. Also checks that everything
+formatted parses back exactly, and that both parsers agree. */
+
+#define COUNT 1000000 // numbers per set
+#define ROUNDS 5 // passes over each set per measurement
+
+typedef struct {
+	const char* name;
+	double (*make)(uint64_t random);
+} NumberSet;
+
+static uint64_t next_random(uint64_t* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static double any_double(uint64_t random)
+{
+	double number;
+	if ((random >> 52 & 0x7FF) == 0x7FF)
+		random ^= 1ull << 62; // infinities and NaNs become ordinary numbers
+	memcpy(&number, &random, sizeof(number));
+	return number;
+}
+
+static double integer(uint64_t random)
+{
+	return (double)(random % 1000000000);
+}
+
+static double cents(uint64_t random)
+{
+	return (double)(random % 10000000) / 100;
+}
+
+static double ratio(uint64_t random)
+{
+	return (double)(random % 1000 + 1) / (double)((random >> 32) % 1000 + 1);
+}
+
+static const NumberSet sets[] = {
+	{ "integers", integer },
+	{ "cents", cents },
+	{ "ratios", ratio },
+	{ "any bits", any_double },
+};
+
+static double seconds_since(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(const char* what, double seconds)
+{
+	printf("  %-14s %8.1f M/s\n", what, seconds > 0 ? COUNT * ROUNDS / seconds / 1e6 : 0.0);
+}
+
+static void benchmark(const NumberSet* set)
+{
+	double* numbers = malloc(COUNT * sizeof(double));
+	char* texts = malloc(COUNT * (size_t)NUMBER_FORMAT_MAX);
+	if (numbers == NULL || texts == NULL) exit(1);
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < COUNT; ++i)
+		numbers[i] = set->make(next_random(&state));
+
+	printf("%s:\n", set->name);
+	char buffer[NUMBER_FORMAT_MAX];
+	volatile size_t sink = 0;
+
+	clock_t start = clock();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < COUNT; ++i)
+			sink += snprintf(buffer, sizeof(buffer), "%g", numbers[i]);
+	report("printf %g", seconds_since(start));
+
+	start = clock();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < COUNT; ++i)
+			sink += snprintf(buffer, sizeof(buffer), "%.17g", numbers[i]);
+	report("printf %.17g", seconds_since(start));
+
+	start = clock();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < COUNT; ++i)
+			sink += number_format(numbers[i], &texts[i * NUMBER_FORMAT_MAX]);
+	report("number_format", seconds_since(start));
+
+	start = clock();
+	double total = 0;
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < COUNT; ++i)
+			total += strtod(&texts[i * NUMBER_FORMAT_MAX], NULL);
+	report("strtod", seconds_since(start));
+
+	start = clock();
+	for (int r = 0; r < ROUNDS; ++r) {
+		for (size_t i = 0; i < COUNT; ++i) {
+			const char* text = &texts[i * NUMBER_FORMAT_MAX];
+			double number = 0;
+			number_parse(text, strlen(text), &number);
+			total += number;
+		}
+	}
+	report("number_parse", seconds_since(start));
+	(void)sink;
+	(void)total;
+
+	size_t lossy = 0, disagreements = 0;
+	for (size_t i = 0; i < COUNT; ++i) {
+		const char* text = &texts[i * NUMBER_FORMAT_MAX];
+		double parsed = 0;
+		const bool ok = number_parse(text, strlen(text), &parsed);
+		const double expected = strtod(text, NULL);
+		lossy += !ok || memcmp(&parsed, &numbers[i], sizeof(double)) != 0;
+		disagreements += memcmp(&parsed, &expected, sizeof(double)) != 0;
+	}
+	printf("  %zu lossy round trips, %zu disagreements with strtod\n", lossy, disagreements);
+
+	free(texts);
+	free(numbers);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); ++i)
+		benchmark(&sets[i]);
+	return 0;
+}
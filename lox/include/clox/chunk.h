@@ -14,14 +14,16 @@ enum OpCode {
 	OP_GET_GLOBAL, OP_DEFINE_GLOBAL, OP_SET_GLOBAL,
 	OP_GET_UPVALUE, OP_SET_UPVALUE,
 	OP_GET_PROPERTY, OP_SET_PROPERTY,
+	OP_GET_METHOD,
 	OP_GET_SUPER,
+	OP_BUILD_LIST, OP_BUILD_MAP, OP_BUILD_STRING, OP_GET_INDEX, OP_SET_INDEX,
 	OP_EQUAL, OP_GREATER, OP_LESS,
 	OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE,
 	OP_NOT, OP_NEGATE,
 	OP_PRINT,
 	OP_JUMP, OP_JUMP_IF_FALSE, OP_LOOP,
 	OP_CALL,
-	OP_INVOKE, OP_SUPER_INVOKE,
+	OP_INVOKE, OP_SUPER_INVOKE, OP_CALL_METHOD,
 	OP_CLOSURE, OP_CLOSE_UPVALUE,
 	OP_RETURN,
 	OP_CLASS, OP_INHERIT, OP_METHOD,
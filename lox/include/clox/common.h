@@ -17,16 +17,83 @@
 // Prints dynamic memory management during the Lox runtime.
 #define DEBUG_LOG_GC 0
 
+// Prints method cache statistics when the VM is destroyed.
+#define DEBUG_LOG_METHOD_CACHE 0
+
 // Makes the GC run on every allocation.
 #define DEBUG_STRESS_GC 0
 
 // Initial heap size, in bytes.
 #define GC_HEAP_INITIAL (1024 * 1024)
 
+// Size (and alignment) of GC heap pages, in bytes. Must be a power of two.
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+/* Whether the GC objects of each heap should live in a 4 GiB region reserved for
+it, so that the references between them can be stored as 32-bit offsets. It
+needs mmap() and only makes sense with 64-bit pointers. Since that's 4 GiB of
+address space for every VM, more than limits on virtual memory (ulimit -v) may
+allow, it's only done when the build asks for it (with LOX_COMPRESSED_REFS). */
+#if !defined(HEAP_COMPRESSED_REFS) || !defined(__unix__) || UINTPTR_MAX <= UINT32_MAX
+#	undef HEAP_COMPRESSED_REFS
+#	define HEAP_COMPRESSED_REFS 0
+#endif
+
+/* Whether the GC should compact the heap, moving objects out of its sparsest
+pages, once less than GC_COMPACT_OCCUPANCY percent of its cells are in use. */
+#define GC_COMPACTION 1
+#define GC_COMPACT_OCCUPANCY 50
+
+/* Tables grow when more than TABLE_MAX_LOAD percent of their slots are taken
+(counting tombstones), and shrink when less than TABLE_MIN_LOAD percent of them
+hold entries. The latter should stay below half of the former, or else tables
+could keep growing and shrinking back. */
+#define TABLE_MAX_LOAD 87
+#define TABLE_MIN_LOAD 25
+
+/* How many fields instances store inline (up to 63), with lookups comparing
+each name in order. Only the fields past these need a hash table. */
+#define INSTANCE_INLINE_FIELDS 6
+
+/* How many recently bound methods the VM remembers, so that getting the same
+method from the same instance over and over again doesn't keep allocating. */
+#define BOUND_METHOD_CACHE 64
+
+/* How many (class, name) lookups are cached VM-wide for classes whose methods
+are too sparse for a vtable. */
+#define METHOD_CACHE_SIZE 256
+
+/* Size of the buffer holding the VM's output (in bytes) until it's flushed, which
+happens when it fills up, on errors, on exit, on calls to flush() and, when
+stdout is a terminal, at the end of every line. */
+#define OUTPUT_BUFFER_SIZE (16 * 1024)
+
+/* Initial size of the buffer of each open file (in bytes). Reads are done in
+chunks this big, and so are writes unless closed sooner. Reading lines longer
+than this makes the buffer grow. */
+#define FILE_BUFFER_SIZE (64 * 1024)
+
+/* Concatenations resulting in strings at least this long are done lazily, with
+ropes, so that building big strings piece by piece doesn't take quadratic time.
+Substrings at least this long share their contents with the original string. */
+#define STRING_ROPE_MIN 64
+
+/* Whether tables should hash strings a word at a time (wyhash-style) instead of
+byte by byte, with FNV-1a. See apps/hashbench.c for a comparison of the two. */
+#define FAST_STRING_HASH 1
+
 /* Whether or not to use NaN boxing to save space occupied by Lox Values.
 See http://craftinginterpreters.com/optimization.html#nan-boxing for info. */
 #define NAN_BOXING 1
 
+/* Whether bulk numeric kernels (see kernels.h) may use x86 SIMD instructions,
+which are only picked at runtime if the CPU supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define SIMD_KERNELS 1
+#else
+#	define SIMD_KERNELS 0
+#endif
+
 // Whether the main VM loop should use computed gotos instead of switching.
 #ifdef __GNUC__
 #	define COMPUTED_GOTO 1
@@ -0,0 +1,133 @@
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h" // size_t, bool, uint32_t, uintptr_t, HEAP_COMPRESSED_REFS
+
+
+// Forward declarations due to cyclic dependencies.
+struct Obj;
+struct HeapPage;
+struct HeapSpan;
+
+#define HEAP_SIZE_CLASSES 68
+
+#if HEAP_COMPRESSED_REFS
+
+// Part of a heap's region, from which blocks are bump-allocated and reused first-fit.
+typedef struct {
+	char* top;
+	char* end;
+	size_t granule; // blocks are multiples of this, which is also their alignment
+	struct HeapSpan* free;
+} HeapArena;
+
+#endif // HEAP_COMPRESSED_REFS
+
+/** Paged storage for GC objects. Small objects share pages of equally-sized
+ * cells, while big ones get a page of their own. Allocation and mark bits are
+ * kept in bitmaps apart from the pages, so a collection never writes to live
+ * objects and sweeping can go through them a word at a time. */
+typedef struct {
+	struct HeapPage* pages[HEAP_SIZE_CLASSES];
+	struct HeapPage* current[HEAP_SIZE_CLASSES];
+	struct HeapPage* large;
+	struct HeapPage* evacuated;
+	size_t used; // bytes in small object cells which are allocated
+	size_t capacity; // bytes in small object cells overall
+#if HEAP_COMPRESSED_REFS
+	char* base; // of the region reserved for this heap, or NULL if that failed
+	HeapArena small; // pages of small cells, in the lower half of the region
+	HeapArena big; // blocks of large objects, in the upper half
+#endif
+} Heap;
+
+#undef HEAP_SIZE_CLASSES
+
+#if HEAP_COMPRESSED_REFS
+
+/* Each heap carves its pages out of its own 4 GiB region, aligned to its size,
+so references between GC objects fit in 32 bits as the low half of an address,
+while the high half comes from the address of the object holding them. No cell
+starts at offset 0, which then works as NULL. */
+typedef uint32_t HeapRef;
+
+inline HeapRef heap_ref(const struct Obj* object)
+{
+	return (HeapRef)(uintptr_t)object;
+}
+
+// Gets the object referenced by REF, which is stored in HOLDER.
+inline struct Obj* heap_deref(const struct Obj* holder, HeapRef ref)
+{
+	const uintptr_t base = (uintptr_t)holder & ~(uintptr_t)UINT32_MAX;
+	return ref != 0 ? (struct Obj*)(base | ref) : NULL;
+}
+
+#else
+
+typedef struct Obj* HeapRef;
+
+inline HeapRef heap_ref(const struct Obj* object)
+{
+	return (struct Obj*)object;
+}
+
+// Gets the object referenced by REF, which is stored in HOLDER.
+inline struct Obj* heap_deref(const struct Obj* holder, HeapRef ref)
+{
+	return ref;
+}
+
+#endif // HEAP_COMPRESSED_REFS
+
+// Callback used to release resources owned by an object about to be reclaimed.
+typedef void (*HeapFinalizer)(struct Obj* object, void* forward);
+
+// Callback used to visit objects in the heap.
+typedef void (*HeapVisitor)(struct Obj* object, void* forward);
+
+// Callback notified after an object was copied from address FROM to address TO.
+typedef void (*HeapMover)(struct Obj* to, const struct Obj* from, void* forward);
+
+
+// Initializes an empty HEAP. heap_destroy() must be called on it later.
+void heap_init(Heap* heap);
+
+// Reclaims all pages in HEAP, calling FINALIZE on every object still in it.
+void heap_destroy(Heap* heap, HeapFinalizer finalize, void* forward);
+
+// Returns an uninitialized cell with at least SIZE bytes, or NULL when out of memory.
+struct Obj* heap_allocate(Heap* heap, size_t size);
+
+// Gets the usable size, in bytes, of the cell holding OBJECT.
+size_t heap_cell_size(const struct Obj* object);
+
+// Sets OBJECT's mark bit and returns whether it was already set.
+bool heap_mark(struct Obj* object);
+
+// Clears OBJECT's mark bit.
+void heap_unmark(struct Obj* object);
+
+// Checks whether OBJECT has been marked since the last sweep.
+bool heap_is_marked(const struct Obj* object);
+
+/** Reclaims every unmarked object in HEAP (after calling FINALIZE on it) and
+ * then clears all marks. Returns the amount of bytes freed. */
+size_t heap_sweep(Heap* heap, HeapFinalizer finalize, void* forward);
+
+// Calls VISIT on every object currently allocated in HEAP.
+void heap_for_each(Heap* heap, HeapVisitor visit, void* forward);
+
+/** Moves objects out of sparsely occupied pages and into the holes of denser
+ * ones, calling MOVED on each copy. Evacuated pages are kept around so that
+ * heap_forward() works, until heap_release_evacuated() is called after every
+ * reference to a moved object has been updated. Returns the number of moves. */
+size_t heap_evacuate(Heap* heap, HeapMover moved, void* forward);
+
+// Gets the current address of OBJECT, which may have been moved by heap_evacuate().
+struct Obj* heap_forward(struct Obj* object);
+
+// Releases the pages emptied by heap_evacuate().
+void heap_release_evacuated(Heap* heap);
+
+#endif // CLOX_HEAP_H
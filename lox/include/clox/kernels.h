@@ -0,0 +1,32 @@
+#ifndef CLOX_KERNELS_H
+#define CLOX_KERNELS_H
+
+#include "common.h" // size_t
+
+
+/* Bulk operations over arrays of N doubles, all of them implemented for the same
+instruction set. Vectorized sums are added in a different order, so their results
+may differ from a sequential loop in the last bits. */
+typedef struct {
+	// Adds up all items in A.
+	double (*sum)(const double* a, size_t n);
+	// Adds up the products of each pair of items in A and B.
+	double (*dot)(const double* a, const double* b, size_t n);
+	// Multiplies every item in A by K, in place.
+	void (*scale)(double* a, double k, size_t n);
+	// Adds every item in B to the corresponding one in A, in place.
+	void (*add)(double* a, const double* b, size_t n);
+	// Gets the smallest of N > 0 items in A, or NaN when there's any NaN.
+	double (*min)(const double* a, size_t n);
+	// Gets the largest of N > 0 items in A, or NaN when there's any NaN.
+	double (*max)(const double* a, size_t n);
+} Kernels;
+
+/** Picks the best kernels this CPU supports: those using SIMD instructions (AVX2
+ * or SSE2) where available, or plain loops otherwise. */
+const Kernels* kernels_select(void);
+
+// Sorts the items in A in ascending order, with NaNs at the end.
+void f64_sort(double* a, size_t n);
+
+#endif // CLOX_KERNELS_H
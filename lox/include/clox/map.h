@@ -0,0 +1,55 @@
+#ifndef CLOX_MAP_H
+#define CLOX_MAP_H
+
+#include <ugly/hash.h> // hash_t
+
+#include "value.h" // Value
+#include "common.h" // bool, int32_t
+
+
+// Forward declarations due to cyclic dependencies.
+struct Environment;
+struct MapEntry;
+
+/** Hash table from arbitrary Values to Values, which remembers insertion order.
+ * Entries are stored densely, in the order they were added, while a separate
+ * open-addressing index of their positions is what gets probed. So iteration is
+ * a linear scan, and rehashing never needs to look at the keys again.
+ *
+ * Numbers are hashed by value (so that 1 and 1.0 are the same key), strings by
+ * contents and other objects by identity, with a hash kept in their header so
+ * that it stays the same even if the GC moves them. */
+typedef struct {
+	struct MapEntry* entries; // deleted ones are left as holes until a rehash
+	int32_t* index; // stored right after the entries, in the same allocation
+	int capacity; // slots in the index, zero or a power of two
+	int count; // live entries
+	int used; // entries, including holes
+	struct Environment* env;
+} ValueMap;
+
+
+// Initializes an empty MAP. value_map_destroy() must be called on it later.
+void value_map_init(ValueMap* map, struct Environment* env);
+
+// Deallocates any resources acquired by value_map_init().
+void value_map_destroy(ValueMap* map);
+
+/** Copies the value associated with KEY in MAP into VALUE. Returns true when
+ * the entry was found, otherwise false. Strings in keys must be flat. */
+bool value_map_get(const ValueMap* map, Value key, Value* value);
+
+/** Associates KEY with VALUE in MAP, both of which must be reachable by the GC
+ * since this may allocate. Returns true if KEY already existed. */
+bool value_map_put(ValueMap* map, Value key, Value value);
+
+/** Deletes the entry for KEY from MAP, copying its value into VALUE (if not
+ * NULL). Returns true on success. */
+bool value_map_delete(ValueMap* map, Value key, Value* value);
+
+/** Iterates, in insertion order, through all entries in MAP, calling FUNC on
+ * each one with an extra forwarded argument, eg: FUNC(k, v, FORWARD). Keys may
+ * only be replaced by equal values with the same hash (as when moved by the GC). */
+void value_map_for_each(ValueMap* map, void (*func)(Value*, Value*, void*), void* forward);
+
+#endif // CLOX_MAP_H
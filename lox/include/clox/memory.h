@@ -7,7 +7,14 @@
 // GC allocator following realloc's protocol, with added ENV and WHY parameters.
 void* reallocate(Environment* env, void* ptr, size_t size, const char* why);
 
+// GC allocator for a heap cell of at least SIZE bytes, which only collect_garbage() reclaims.
+Obj* allocate_cell(Environment* env, size_t size, const char* why);
+
 // GC collector.
 void collect_garbage(Environment *env);
 
+/** Full GC collection which also compacts the heap by moving objects around.
+ * May only be called at safe points, where every object pointer is in a root. */
+void compact_garbage(Environment *env);
+
 #endif // CLOX_MEMORY_H
@@ -0,0 +1,25 @@
+#ifndef CLOX_NUMBER_H
+#define CLOX_NUMBER_H
+
+#include "common.h" // size_t, bool
+
+
+/* Conversions between doubles and their decimal representations. Unlike printf
+and strtod, these don't depend on the C locale, and formatting always yields the
+fewest digits needed to read the number back exactly. */
+
+// Size of a buffer big enough for any number formatted by number_format().
+#define NUMBER_FORMAT_MAX 32
+
+/** Writes the shortest decimal representation of NUMBER that parses back as the
+ * same double into BUFFER (null-terminated), and returns its length. Magnitudes
+ * from 1e-6 up to 1e21 are written in plain notation (like 0.1 or 1234.5), and
+ * everything else with an exponent (like 1e+21 or 2.5e-7). */
+int number_format(double number, char buffer[NUMBER_FORMAT_MAX]);
+
+/** Parses all N chars at START as a decimal number, with an optional minus sign,
+ * fraction and exponent (as in -12.5e3), rounding it to the nearest double. On
+ * success, that goes into RESULT. Otherwise, returns false. */
+bool number_parse(const char* start, size_t n, double* result);
+
+#endif // CLOX_NUMBER_H
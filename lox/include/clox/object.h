@@ -1,40 +1,72 @@
 #ifndef CLOX_OBJECT_H
 #define CLOX_OBJECT_H
 
+#include <stdio.h> // FILE
+
 #include <ugly/hash.h>
 
 #include "value.h"
 #include "common.h" // bool
 #include "table.h"
 #include "chunk.h"
+#include "heap.h" // HeapRef
+#include "map.h"
 
 
 // Possible Obj types.
 typedef enum {
 	OBJ_BOUND_METHOD,
+	OBJ_BYTES,
 	OBJ_CLASS,
 	OBJ_CLOSURE,
+	OBJ_FILE,
+	OBJ_FLOAT64_ARRAY,
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
+	OBJ_LIST,
+	OBJ_MAP,
 	OBJ_NATIVE,
+	OBJ_ROPE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
 } ObjType;
 
+/* Header common to all Lox objects, packed into 8 bytes. It has no room for GC
+bits, since those are kept apart in the heap, and it holds the hash of strings
+because that would otherwise be padding. Other objects use it for their identity
+hash, assigned when they're first used as a map key. */
 struct Obj {
-	ObjType type;
-	struct Obj* next;
-	bool marked;
+	uint8_t type; // ObjType
+	uint8_t flags; // reserved for per-type bits
+	uint32_t hash;
 };
 
+/* Strings made by the compiler are interned, so that identifiers can be compared
+by address. Those made at runtime are not, and only get hashed when needed. */
 struct ObjString {
-	struct Obj obj;
+	struct Obj obj; // flags are StringFlags
 	//
-	hash_t hash;
 	size_t length;
-	char* chars;
+	char chars[]; // null-terminated, allocated along with the object
 };
 
+typedef enum {
+	STRING_HASHED = 1 << 0,
+	STRING_INTERNED = 1 << 1,
+} StringFlags;
+
+/* Lazy concatenation of two strings (or ropes), flattened only when needed. Ropes
+without a right side are slices of the string on their left instead. */
+typedef struct {
+	struct Obj obj;
+	//
+	size_t length;
+	HeapRef left; // ObjString or ObjRope, or the ObjString sliced
+	HeapRef right; // ObjString or ObjRope, or 0 for slices
+	HeapRef flat; // ObjString, and once flattened, the above are released
+	size_t start; // where slices begin in LEFT
+} ObjRope;
+
 typedef struct {
 	struct Obj obj;
 	//
@@ -44,7 +76,9 @@ typedef struct {
 	Chunk bytecode;
 } ObjFunction;
 
-typedef bool (*NativeFn)(int arc, Value argv[]);
+/* Natives get the environment (so that they can allocate) and their ARGC
+arguments in ARGV, while ARGV[-1] is where they put their result. */
+typedef bool (*NativeFn)(struct Environment* env, int argc, Value argv[]);
 
 typedef struct {
 	struct Obj obj;
@@ -64,24 +98,47 @@ typedef struct {
 	struct Obj obj;
 	//
 	ObjFunction* function;
-	int upvalue_count;
-	ObjUpvalue** upvalues;
+	ObjUpvalue** upvalues; // as many as function->upvalues
 } ObjClosure;
 
+/* Besides their method table, classes have a vtable indexed by selector, which
+is the (environment-wide) constant index of a method's name, so dispatch takes
+a bounds check and a load. Classes whose selectors are too spread out for that
+are marked as sparse and only use their table. */
 typedef struct {
-	struct Obj obj;
+	struct Obj obj; // flags are ClassFlags
 	//
 	ObjString* name;
 	Table methods;
+	ObjClosure** vtable; // indexed by selector - vtable_base, NULL where missing
+	int vtable_base;
+	int vtable_size;
 } ObjClass;
 
+typedef enum {
+	CLASS_SPARSE = 1 << 0,
+} ClassFlags;
+
+/* Instances keep their first INSTANCE_INLINE_FIELDS fields in the object itself,
+so small ones never need to allocate a table. */
 typedef struct {
-	struct Obj obj;
+	struct Obj obj; // flags are InstanceFlags
 	//
-	ObjClass* class;
-	Table fields;
+	HeapRef class; // ObjClass
+	HeapRef names[INSTANCE_INLINE_FIELDS]; // ObjStrings
+	Value values[INSTANCE_INLINE_FIELDS];
+	Table* fields; // only those which didn't fit inline, allocated when needed
 } ObjInstance;
 
+typedef enum {
+	INSTANCE_INLINE_COUNT = 0x3F, // mask for how many inline fields are in use
+	INSTANCE_UNINTERNED = 1 << 6, // some inline field name may not be interned
+} InstanceFlags;
+
+#if INSTANCE_INLINE_FIELDS > 63
+#	error "INSTANCE_INLINE_FIELDS is too big"
+#endif
+
 typedef struct {
 	struct Obj obj;
 	//
@@ -89,10 +146,61 @@ typedef struct {
 	ObjClosure* method;
 } ObjBoundMethod;
 
+// Growable sequence of values, which are kept contiguous.
+typedef struct {
+	struct Obj obj;
+	//
+	Value* items;
+	int count;
+	int capacity;
+} ObjList;
+
+// Fixed-length array of unboxed doubles, meant for bulk numeric work.
+typedef struct {
+	struct Obj obj;
+	//
+	double* items;
+	int count;
+} ObjFloat64Array;
+
+/* Mutable sequence of bytes. Slices are views into the storage of another
+buffer (their owner, which they keep alive), so they see its changes and don't
+copy anything until they're appended to. */
+typedef struct {
+	struct Obj obj;
+	//
+	HeapRef owner; // ObjBytes, only for slices
+	uint8_t* data; // owned storage, NULL for slices
+	int offset; // into the owner's data, only for slices
+	int length;
+	int capacity; // of owned storage
+} ObjBytes;
+
+/* Open file, either read ahead into a buffer of its own or written through an
+Output. Files which become unreachable are flushed and closed by the GC. */
+typedef struct {
+	struct Obj obj;
+	//
+	FILE* stream; // NULL once closed
+	bool writing;
+	char* buffer;
+	int capacity; // of the buffer
+	int start; // of the bytes read ahead into the buffer
+	int end;
+	Output output; // into the buffer, when writing
+} ObjFile;
+
+// Hash table keyed by any values, see ValueMap.
+typedef struct {
+	struct Obj obj;
+	//
+	ValueMap map;
+} ObjMap;
+
 
 inline ObjType obj_type(Value value)
 {
-	return value_as_obj(value)->type;
+	return (ObjType)value_as_obj(value)->type;
 }
 
 inline bool value_obj_is_type(Value value, ObjType type)
@@ -105,6 +213,17 @@ inline bool value_is_string(Value value)
 	return value_obj_is_type(value, OBJ_STRING);
 }
 
+inline bool value_is_rope(Value value)
+{
+	return value_obj_is_type(value, OBJ_ROPE);
+}
+
+// Whether VALUE is a Lox string, regardless of its representation.
+inline bool value_is_string_or_rope(Value value)
+{
+	return value_is_string(value) || value_is_rope(value);
+}
+
 inline bool value_is_function(Value value)
 {
 	return value_obj_is_type(value, OBJ_FUNCTION);
@@ -135,6 +254,31 @@ inline bool value_is_method(Value value)
 	return value_obj_is_type(value, OBJ_BOUND_METHOD);
 }
 
+inline bool value_is_list(Value value)
+{
+	return value_obj_is_type(value, OBJ_LIST);
+}
+
+inline bool value_is_map(Value value)
+{
+	return value_obj_is_type(value, OBJ_MAP);
+}
+
+inline bool value_is_bytes(Value value)
+{
+	return value_obj_is_type(value, OBJ_BYTES);
+}
+
+inline bool value_is_float64_array(Value value)
+{
+	return value_obj_is_type(value, OBJ_FLOAT64_ARRAY);
+}
+
+inline bool value_is_file(Value value)
+{
+	return value_obj_is_type(value, OBJ_FILE);
+}
+
 inline ObjString* value_as_string(Value value)
 {
 	return (ObjString*)value_as_obj(value);
@@ -145,6 +289,11 @@ inline char* value_as_c_str(Value value)
 	return value_as_string(value)->chars;
 }
 
+inline ObjRope* value_as_rope(Value value)
+{
+	return (ObjRope*)value_as_obj(value);
+}
+
 inline ObjFunction* value_as_function(Value value)
 {
 	return (ObjFunction*)value_as_obj(value);
@@ -175,19 +324,136 @@ inline ObjBoundMethod* value_as_method(Value value)
 	return (ObjBoundMethod*)value_as_obj(value);
 }
 
-void obj_print(Value value);
+inline ObjList* value_as_list(Value value)
+{
+	return (ObjList*)value_as_obj(value);
+}
+
+inline ObjBytes* value_as_bytes(Value value)
+{
+	return (ObjBytes*)value_as_obj(value);
+}
 
-// Deallocates a single OBJECT from ENV's heap.
+inline ObjFloat64Array* value_as_float64_array(Value value)
+{
+	return (ObjFloat64Array*)value_as_obj(value);
+}
+
+inline ObjFile* value_as_file(Value value)
+{
+	return (ObjFile*)value_as_obj(value);
+}
+
+inline ObjMap* value_as_map(Value value)
+{
+	return (ObjMap*)value_as_obj(value);
+}
+
+// Writes VALUE to OUT the way the print statement shows it.
+void obj_write(Value value, Output* out);
+
+// Releases resources owned by a single OBJECT, whose cell is then reclaimed by ENV's heap.
 void free_obj(struct Environment *env, Obj* object);
 
 // Deallocates all Objs from ENV.
 void free_objects(struct Environment *env);
 
-// Allocates a new ObjString while copying given STR.
+// Gets the hash of STRING, which is only computed the first time it's needed.
+inline hash_t obj_string_hash(const ObjString* string)
+{
+	if (!(string->obj.flags & STRING_HASHED)) {
+		ObjString* mutable = (ObjString*)string;
+		mutable->obj.hash = table_hash(string->chars, string->length);
+		mutable->obj.flags |= STRING_HASHED;
+	}
+	return string->obj.hash;
+}
+
+// Compares the contents of two strings, taking shortcuts when possible.
+bool obj_string_equal(const ObjString* a, const ObjString* b);
+
+// Gets the method with the given SELECTOR from CLASS's vtable, or NULL when it isn't there.
+inline ObjClosure* obj_class_dispatch(const ObjClass* class, int selector)
+{
+	const unsigned index = (unsigned)(selector - class->vtable_base);
+	return index < (unsigned)class->vtable_size ? class->vtable[index] : NULL;
+}
+
+/** Adds METHOD to CLASS under NAME, whose constant index is SELECTOR. METHOD
+ * must be reachable by the GC, since this may allocate. */
+void obj_class_define(struct Environment *env, ObjClass* class,
+                      ObjString* name, int selector, ObjClosure* method);
+
+// Copies every method in SUPERCLASS into CLASS.
+void obj_class_inherit(struct Environment *env, ObjClass* class, const ObjClass* superclass);
+
+inline ObjClass* obj_instance_class(const ObjInstance* instance)
+{
+	return (ObjClass*)heap_deref(&instance->obj, instance->class);
+}
+
+inline int obj_instance_inline_count(const ObjInstance* instance)
+{
+	return instance->obj.flags & INSTANCE_INLINE_COUNT;
+}
+
+// Gets the index of inline field NAME in INSTANCE, or -1 when it isn't there.
+inline int obj_instance_find_inline(const ObjInstance* instance, const ObjString* name)
+{
+	const int count = obj_instance_inline_count(instance);
+	const HeapRef ref = heap_ref(&name->obj);
+	for (int i = 0; i < count; ++i) {
+		if (instance->names[i] == ref) return i;
+	}
+
+	// different interned strings always have different contents
+	if ((name->obj.flags & STRING_INTERNED) && !(instance->obj.flags & INSTANCE_UNINTERNED))
+		return -1;
+	for (int i = 0; i < count; ++i) {
+		if (obj_string_equal((const ObjString*)heap_deref(&instance->obj, instance->names[i]), name)) return i;
+	}
+	return -1;
+}
+
+/** Copies the value of field NAME in INSTANCE into VALUE. Returns true when the
+ * field was found, otherwise false. */
+inline bool obj_instance_get(const ObjInstance* instance, const ObjString* name, Value* value)
+{
+	const int i = obj_instance_find_inline(instance, name);
+	if (i >= 0) {
+		*value = instance->values[i];
+		return true;
+	}
+	return instance->fields != NULL && table_get(instance->fields, name, value);
+}
+
+// Sets field NAME in INSTANCE to VALUE. Returns true if the field already existed.
+bool obj_instance_set(struct Environment *env, ObjInstance* instance, ObjString* name, Value value);
+
+// Deletes field NAME from INSTANCE. Returns true on success.
+bool obj_instance_delete(ObjInstance* instance, const ObjString* name);
+
+// Gets the interned ObjString equal to STR, allocating a copy of it if needed.
 ObjString* make_obj_string(struct Environment *env, const char* str, size_t str_len);
 
-// Allocates a new ObjString which is the concatenation of PREFIX and SUFFIX.
-ObjString* obj_string_concat(struct Environment *env, const ObjString* prefix, const ObjString* sufix);
+// Allocates a new, uninterned ObjString with a copy of STR, which only gets hashed when needed.
+ObjString* make_obj_string_uninterned(struct Environment *env, const char* str, size_t str_len);
+
+// Allocates a new, uninterned ObjString of LENGTH chars, which are left for the caller to fill.
+ObjString* make_obj_string_buffer(struct Environment *env, size_t length);
+
+/** Allocates a new string which is the concatenation of PREFIX and SUFFIX (each
+ * either an ObjString or an ObjRope). Short results are copied right away into
+ * an (uninterned) ObjString, while longer ones get an ObjRope. */
+Obj* obj_string_concat(struct Environment *env, Obj* prefix, Obj* suffix);
+
+/** Allocates a new string with the LENGTH chars of STRING from START. Short
+ * results are copied right away into an (uninterned) ObjString, while longer
+ * ones get an ObjRope which shares the contents of STRING until flattened. */
+Obj* obj_string_slice(struct Environment *env, ObjString* string, size_t start, size_t length);
+
+// Gets an ObjString with the contents of ROPE, which keeps it cached.
+ObjString* obj_rope_flatten(struct Environment *env, ObjRope* rope);
 
 // Allocates a new ObjFunction in ENV's heap.
 ObjFunction* make_obj_function(struct Environment *env);
@@ -210,4 +476,64 @@ ObjInstance* make_obj_instance(struct Environment *env, ObjClass* class);
 // Allocates a new ObjBoundMethod METHOD bound to RECEIVER.
 ObjBoundMethod* make_obj_method(struct Environment *env, Value receiver, ObjClosure* method);
 
+// Allocates a new, empty ObjList in ENV's heap.
+ObjList* make_obj_list(struct Environment *env);
+
+/** Makes room for at least CAPACITY items in LIST, which must be reachable by
+ * the GC, since this may allocate. */
+void obj_list_reserve(struct Environment *env, ObjList* list, int capacity);
+
+/** Inserts VALUE at position INDEX (up to its count) of LIST, moving the items
+ * after it. Both must be reachable by the GC. Appending takes amortized O(1). */
+void obj_list_insert(struct Environment *env, ObjList* list, int index, Value value);
+
+// Removes the item at position INDEX (below its count) of LIST, returning it.
+Value obj_list_remove(ObjList* list, int index);
+
+// Allocates a new ObjFloat64Array of COUNT zeros in ENV's heap.
+ObjFloat64Array* make_obj_float64_array(struct Environment *env, int count);
+
+// Allocates a new ObjBytes of LENGTH zeros in ENV's heap.
+ObjBytes* make_obj_bytes(struct Environment *env, int length);
+
+/** Allocates a new ObjBytes viewing LENGTH bytes of BYTES from START on, which
+ * must be reachable by the GC. Slices of slices view the original owner. */
+ObjBytes* make_obj_bytes_slice(struct Environment *env, ObjBytes* bytes, int start, int length);
+
+// Gets the first of the bytes in BYTES, which stay put until it's grown.
+inline uint8_t* obj_bytes_data(const ObjBytes* bytes)
+{
+	if (bytes->owner == 0)
+		return bytes->data;
+	return ((const ObjBytes*)heap_deref(&bytes->obj, bytes->owner))->data + bytes->offset;
+}
+
+/** Makes room for at least CAPACITY bytes in BYTES, which must be reachable by
+ * the GC, since this may allocate. Slices get their own copy of their bytes. */
+void obj_bytes_reserve(struct Environment *env, ObjBytes* bytes, int capacity);
+
+/** Appends the N bytes in DATA to BYTES (which must be reachable by the GC),
+ * growing it as needed. DATA may even be in BYTES. Takes amortized O(N). */
+void obj_bytes_append(struct Environment *env, ObjBytes* bytes, const uint8_t* data, int n);
+
+// Allocates a new, empty ObjMap in ENV's heap.
+ObjMap* make_obj_map(struct Environment *env);
+
+/** Allocates a new ObjFile in ENV's heap, which takes over STREAM for either
+ * reading or WRITING. */
+ObjFile* make_obj_file(struct Environment *env, FILE* stream, bool writing);
+
+/** Reads the next line from FILE (which must be reachable by the GC) without
+ * its '\n', or returns NULL once at the end. Only the string is allocated,
+ * since lines are found in the buffer, which only grows for very long ones. */
+ObjString* obj_file_read_line(struct Environment *env, ObjFile* file);
+
+/** Reads up to N bytes from FILE into DESTINATION, returning how many there
+ * were. Whatever wouldn't fit in the buffer goes straight to DESTINATION. */
+size_t obj_file_read(struct Environment *env, ObjFile* file, char* destination, size_t n);
+
+/** Flushes and closes FILE, which is left unusable. Returns whether every read
+ * and write on it succeeded. */
+bool obj_file_close(struct Environment *env, ObjFile* file);
+
 #endif // CLOX_OBJECT_H
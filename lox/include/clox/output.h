@@ -0,0 +1,49 @@
+#ifndef CLOX_OUTPUT_H
+#define CLOX_OUTPUT_H
+
+#include "common.h" // size_t, bool
+
+
+// Destination for flushed output, which gets LENGTH bytes of DATA at a time.
+typedef void (*OutputSink)(void* context, const char* data, size_t length);
+
+/** Buffered text writer. Output piles up in a caller-supplied buffer and only
+ * reaches its sink (stdout, by default) when that is full or when flushed. */
+typedef struct {
+	char* buffer;
+	size_t length;
+	size_t capacity;
+	bool flush_lines; // whether every newline also flushes
+	OutputSink sink;
+	void* context; // forwarded to the sink
+} Output;
+
+
+/** Initializes OUT to buffer up to CAPACITY bytes in BUFFER (which must outlive
+ * it) before writing them to stdout, flushing every line when that's a TTY. */
+void output_init(Output* out, char* buffer, size_t capacity);
+
+/** Flushes OUT and then makes it write to SINK (called with CONTEXT) from now
+ * on, only flushing when its buffer is full or when asked to. */
+void output_set_sink(Output* out, OutputSink sink, void* context);
+
+// Sends everything buffered in OUT to its sink.
+void output_flush(Output* out);
+
+// Writes the N bytes in DATA to OUT.
+void output_write(Output* out, const char* data, size_t n);
+
+// Writes null-terminated STR to OUT.
+void output_str(Output* out, const char* str);
+
+// Writes a single char C to OUT.
+inline void output_char(Output* out, char c)
+{
+	if (out->length == out->capacity)
+		output_flush(out);
+	out->buffer[out->length++] = c;
+	if (c == '\n' && out->flush_lines)
+		output_flush(out);
+}
+
+#endif // CLOX_OUTPUT_H
@@ -1,11 +1,16 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+// How deeply string interpolations can be nested inside each other.
+#define INTERPOLATION_MAX 8
+
 // Lazy Lox tokenizer.
 typedef struct {
 	int line;
 	const char* start;
 	const char* current;
+	int interpolations; // how many of them are open
+	int braces[INTERPOLATION_MAX]; // unclosed '{'s inside each open interpolation
 } Scanner;
 
 // Enumeration of valid Lox tokens, plus some extra signaling tokens.
@@ -13,7 +18,8 @@ typedef enum {
 	// Single-character tokens.
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-	TOKEN_COMMA, TOKEN_DOT,
+	TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+	TOKEN_COMMA, TOKEN_DOT, TOKEN_COLON,
 	TOKEN_MINUS, TOKEN_PLUS,
 	TOKEN_SEMICOLON,
 	TOKEN_SLASH, TOKEN_STAR,
@@ -26,6 +32,7 @@ typedef enum {
 
 	// Literals.
 	TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+	TOKEN_INTERPOLATION, // the part of a string before each "${"
 
 	// Keywords.
 	TOKEN_AND,
@@ -1,17 +1,28 @@
 #ifndef CLOX_TABLE_H
 #define CLOX_TABLE_H
 
-#include <ugly/map.h>
 #include <ugly/hash.h> // hash_t, fnv_1a
 
 #include "value.h" // Value, forward declaration of object.h
-#include "common.h" // bool
+#include "common.h" // bool, size_t, uint8_t
 
 
-// Forward declaration due to cyclic dependencies.
+// Forward declarations due to cyclic dependencies.
 struct Environment;
+struct TableEntry;
 
-typedef map_t Table;
+/** Open-addressing hash table from ObjString keys to Values. Each slot has a
+ * control byte holding 7 bits of its key's hash (or marking it as empty or as a
+ * tombstone), and those bytes are probed 8 at a time, so keys are only compared
+ * on likely matches, and mostly by address. */
+typedef struct {
+	struct TableEntry* entries;
+	uint8_t* control; // stored right after the entries, in the same allocation
+	size_t capacity; // zero or a power of two
+	size_t count; // live entries
+	size_t used; // live entries and tombstones
+	struct Environment* env;
+} Table;
 
 
 // Initializes an empty TABLE. table_destroy() must be called on it later.
@@ -28,22 +39,35 @@ bool table_get(const Table* table, const ObjString* key, Value* value);
 ObjString* table_find_string(const Table* table, const char* str, size_t length,
                              hash_t hash);
 
-// The hashing function internally used in tables.
-inline hash_t table_hash(const void* ptr, size_t n)
-{
-	return fnv_1a(ptr, n);
-}
+// The hashing function internally used in tables, whose results fit in 32 bits.
+hash_t table_hash(const void* ptr, size_t n);
 
 // Adds the (KEY -> VALUE) pair to TABLE. Returns true if key already existed.
 bool table_put(Table* table, const ObjString* key, Value value);
 
-// Deletes the entry associated with KEY from the TABLE. Returns true on success.
+/** Deletes the entry associated with KEY from the TABLE, which may then shrink.
+ * Returns true on success. */
 bool table_delete(Table* table, const ObjString* key);
 
+/** Deletes every entry in TABLE for which PREDICATE(k, v, FORWARD) is true and
+ * returns how many were deleted. Never allocates, so the GC may call it. */
+size_t table_delete_if(Table* table,
+                       bool (*predicate)(const ObjString*, Value*, void*),
+                       void* forward);
+
+// Rehashes TABLE into fewer slots when less than TABLE_MIN_LOAD percent are in use.
+void table_shrink(Table* table);
+
 /** Iterates (in unspecified order) through all entries in TABLE, calling FUNC
  * on each one with an extra forwarded argument, eg: FUNC(k, v, FORWARD). */
 void table_for_each(const Table* table,
                     void (*func)(const ObjString*, Value*, void*),
                     void* forward);
 
+/** Like table_for_each(), but FUNC may also replace each key by another string
+ * with the same contents (as is the case for strings moved by the GC). */
+void table_for_each_entry(Table* table,
+                          void (*func)(ObjString**, Value*, void*),
+                          void* forward);
+
 #endif // CLOX_TABLE_H
@@ -1,9 +1,13 @@
 #ifndef CLOX_VALUE_H
 #define CLOX_VALUE_H
 
+#include <math.h> // signbit
+
 #include <ugly/list.h>
 
-#include "common.h" // bool, uint64_t, NAN_BOXING
+#include "common.h" // bool, uint64_t, int32_t, NAN_BOXING
+#include "output.h" // Output
+#include "number.h" // NUMBER_FORMAT_MAX
 
 
 // Forward declaration due to cyclic dependencies.
@@ -29,11 +33,14 @@ typedef enum {
 #define TAG_NIL   1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE  3 // 11
+#define TAG_INT ((uint64_t)0x0001000000000000) // just below QNAN, for int32_t payloads
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 
-// Lox values with NaN boxing optimization applied.
+/* Lox values with NaN boxing optimization applied. Numbers which are integers
+may also be boxed as such, which is only visible through the value_*_int API;
+to everything else they're just numbers. */
 typedef uint64_t Value;
 
 union ValueBox {
@@ -48,8 +55,24 @@ inline Value number_value(double number)
 	return data.bits;
 }
 
+inline Value int_value(int32_t number)
+{
+	return (Value)(QNAN | TAG_INT | (uint32_t)number);
+}
+
+inline bool value_is_int(Value value)
+{
+	return (value & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT);
+}
+
+inline int32_t value_as_int(Value value)
+{
+	return (int32_t)(uint32_t)value;
+}
+
 inline double value_as_number(Value value)
 {
+	if (value_is_int(value)) return value_as_int(value);
 	union ValueBox data;
 	data.bits = value;
 	return data.num;
@@ -57,7 +80,7 @@ inline double value_as_number(Value value)
 
 inline bool value_is_number(Value value)
 {
-	return (value & QNAN) != QNAN;
+	return (value & QNAN) != QNAN || value_is_int(value);
 }
 
 inline Value nil_value(void)
@@ -104,6 +127,7 @@ inline bool value_is_obj(Value value)
 #undef FALSE_VAL
 #undef TRUE_VAL
 #undef NIL_VAL
+#undef TAG_INT
 #undef TAG_TRUE
 #undef TAG_FALSE
 #undef TAG_NIL
@@ -137,6 +161,23 @@ inline bool value_is_number(Value value)
 	return value.type == VAL_NUMBER;
 }
 
+// without NaN boxing, integers are never boxed differently from other numbers
+
+inline Value int_value(int32_t number)
+{
+	return number_value(number);
+}
+
+inline bool value_is_int(Value value)
+{
+	return false;
+}
+
+inline int32_t value_as_int(Value value)
+{
+	return (int32_t)value.as.number;
+}
+
 inline Value nil_value(void)
 {
 	return (Value){ VAL_NIL, { .number = 0 } };
@@ -180,10 +221,32 @@ inline bool value_is_obj(Value value)
 #endif // NAN_BOXING
 
 
-// Pretty-prints VALUE to stdout.
+// Gets a Value for NUMBER, boxed as an integer when that doesn't change it.
+inline Value number_value_compact(double number)
+{
+	const bool integral = number >= INT32_MIN && number <= INT32_MAX
+	                   && number == (int32_t)number
+	                   && (number != 0 || !signbit(number)); // -0 is only a double
+	return integral ? int_value((int32_t)number) : number_value(number);
+}
+
+// Pretty-prints VALUE to stdout, right away.
 void value_print(Value value);
 
-// Compare values A and B for equality.
+// Writes VALUE to OUT, just like value_print() would.
+void value_write(Value value, Output* out);
+
+// Size of a buffer big enough for any number formatted by value_format_number().
+#define VALUE_NUMBER_MAX NUMBER_FORMAT_MAX
+
+/** Writes number VALUE into BUFFER (null-terminated), exactly as value_print()
+ * would print it, and returns its length. That's the shortest representation
+ * which reads back as the same number. */
+int value_format_number(Value value, char buffer[VALUE_NUMBER_MAX]);
+
+/** Compare values A and B for equality. Besides numbers and strings, bound methods
+ * are compared by what they hold: they're equal when they bind the same method
+ * to the same receiver. Other objects are only equal to themselves. */
 bool value_equal(Value a, Value b);
 
 // Initializes an empty ARRAY. value_array_destroy() must be called on it later.
@@ -204,6 +267,12 @@ inline Value value_array_get(const ValueArray* array, int index)
 	return *((Value*)list_ref(array, index));
 }
 
+// Overwrites position INDEX of ARRAY with VALUE.
+inline void value_array_set(ValueArray* array, int index, Value value)
+{
+	*((Value*)list_ref(array, index)) = value;
+}
+
 // Adds VALUE to ARRAY.
 inline void value_array_write(ValueArray* array, Value value)
 {
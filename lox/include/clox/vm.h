@@ -4,10 +4,13 @@
 #include <ugly/stack.h>
 
 #include "chunk.h"
-#include "common.h" // intptr_t, UINT8_MAX, size_t
+#include "common.h" // intptr_t, UINT8_MAX, size_t, BOUND_METHOD_CACHE, METHOD_CACHE_SIZE, OUTPUT_BUFFER_SIZE
 #include "value.h" // Value, ValueArray
 #include "object.h" // Obj, ObjFunction
 #include "table.h"
+#include "heap.h"
+#include "output.h" // Output, OutputSink
+#include "kernels.h" // Kernels
 
 
 // A data container for the information needed during subroutine execution.
@@ -26,18 +29,35 @@ typedef struct Environment {
 	// GC info
 	size_t allocated;
 	size_t next_gc;
+	bool compaction_pending;
+	bool collecting; // collections can't nest, even if they allocate
 	stack_t grays;
 	struct Compiler* compiler;
 	struct VM* vm;
 	// heap data
 	Table globals;
 	ObjUpvalue* open_upvalues;
-	Obj* objects;
+	Heap heap;
 	Table strings;
 	// data segment
 	ValueArray constants;
 } Environment;
 
+// Method found when looking up NAME in CLASS.
+typedef struct {
+	const ObjClass* class; // NULL when unused
+	const ObjString* name;
+	ObjClosure* method;
+} MethodCacheEntry;
+
+/* VM-wide, direct-mapped cache of method lookups which missed the vtable. It
+counts its hits and misses, so that its size can be tuned. */
+typedef struct {
+	MethodCacheEntry entries[METHOD_CACHE_SIZE];
+	size_t hits;
+	size_t misses;
+} MethodCache;
+
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * (UINT8_MAX + 1))
 
@@ -49,6 +69,11 @@ typedef struct VM {
 	Value stack[STACK_MAX];
 	Environment data;
 	ObjString* init_string;
+	ObjBoundMethod* bound_methods[BOUND_METHOD_CACHE]; // weak, cleared by the GC
+	MethodCache method_cache; // also cleared by the GC
+	Output output; // where print goes
+	char output_buffer[OUTPUT_BUFFER_SIZE];
+	const Kernels* kernels; // picked for this CPU by vm_init
 } VM;
 
 #undef STACK_MAX
@@ -79,4 +104,8 @@ void vm_destroy(VM* vm);
 // Executes the VM over the given SOURCE Lox program.
 InterpretResult vm_interpret(VM* vm, const char* source);
 
+/** Makes everything printed by VM go to SINK (called with CONTEXT) instead of
+ * stdout. Output is still buffered, and gets flushed at the same points. */
+void vm_set_output(VM* vm, OutputSink sink, void* context);
+
 #endif // CLOX_VM_H
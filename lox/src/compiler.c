@@ -1,7 +1,6 @@
 #include "compiler.h"
 
 #include <stdio.h> // fprintf
-#include <stdlib.h> // strtod
 #include <string.h> // memcmp
 #include <assert.h>
 
@@ -14,6 +13,7 @@
 #include "table.h"
 #include "common.h" // uint8_t, UINT8_MAX, UINT16_MAX, DEBUG_PRINT_CODE
 #include "vm.h" // constant_add
+#include "number.h" // number_parse
 #if DEBUG_PRINT_CODE
 #	include "debug.h" // disassemble_chunk
 #endif
@@ -34,6 +34,7 @@ typedef struct {
 	bool error;
 	bool panic;
 	Environment* data;
+	intptr_t property_get; // offset of the last OP_GET_PROPERTY emitted, if still the last
 } Parser;
 
 typedef enum {
@@ -64,10 +65,14 @@ static void unary(Parser* parser, bool can_assign);
 static void binary(Parser* parser, bool can_assign);
 static void literal(Parser* parser, bool can_assign);
 static void string(Parser* parser, bool can_assign);
+static void template(Parser* parser, bool can_assign);
 static void variable(Parser* parser, bool can_assign);
 static void and(Parser* parser, bool can_assign);
 static void or(Parser* parser, bool can_assign);
 static void call(Parser* parser, bool can_assign);
+static void list(Parser* parser, bool can_assign);
+static void map(Parser* parser, bool can_assign);
+static void subscript(Parser* parser, bool can_assign);
 static void dot(Parser* parser, bool can_assign);
 static void this(Parser* parser, bool can_assign);
 static void super(Parser* parser, bool can_assign);
@@ -77,46 +82,50 @@ static void statement(Parser* parser);
 static void expression(Parser* parser);
 
 static ParseRule rules[] = {
-	[TOKEN_LEFT_PAREN]    = { grouping, call,   PREC_CALL       },
-	[TOKEN_RIGHT_PAREN]   = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_LEFT_BRACE]    = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_RIGHT_BRACE]   = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_COMMA]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_DOT]           = { NULL,     dot,    PREC_CALL       },
-	[TOKEN_MINUS]         = { unary,    binary, PREC_TERM       },
-	[TOKEN_PLUS]          = { NULL,     binary, PREC_TERM       },
-	[TOKEN_SEMICOLON]     = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_SLASH]         = { NULL,     binary, PREC_FACTOR     },
-	[TOKEN_STAR]          = { NULL,     binary, PREC_FACTOR     },
-	[TOKEN_BANG]          = { unary,    NULL,   PREC_NONE       },
-	[TOKEN_BANG_EQUAL]    = { NULL,     binary, PREC_EQUALITY   },
-	[TOKEN_EQUAL]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_EQUAL_EQUAL]   = { NULL,     binary, PREC_EQUALITY   },
-	[TOKEN_GREATER]       = { NULL,     binary, PREC_COMPARISON },
-	[TOKEN_GREATER_EQUAL] = { NULL,     binary, PREC_COMPARISON },
-	[TOKEN_LESS]          = { NULL,     binary, PREC_COMPARISON },
-	[TOKEN_LESS_EQUAL]    = { NULL,     binary, PREC_COMPARISON },
-	[TOKEN_IDENTIFIER]    = { variable, NULL,   PREC_NONE       },
-	[TOKEN_STRING]        = { string,   NULL,   PREC_NONE       },
-	[TOKEN_NUMBER]        = { number,   NULL,   PREC_NONE       },
-	[TOKEN_AND]           = { NULL,     and,    PREC_AND        },
-	[TOKEN_CLASS]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_ELSE]          = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_FALSE]         = { literal,  NULL,   PREC_NONE       },
-	[TOKEN_FOR]           = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_FUN]           = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_IF]            = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_NIL]           = { literal,  NULL,   PREC_NONE       },
-	[TOKEN_OR]            = { NULL,     or,     PREC_OR         },
-	[TOKEN_PRINT]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_RETURN]        = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_SUPER]         = { super,    NULL,   PREC_NONE       },
-	[TOKEN_THIS]          = { this,     NULL,   PREC_NONE       },
-	[TOKEN_TRUE]          = { literal,  NULL,   PREC_NONE       },
-	[TOKEN_VAR]           = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_WHILE]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_ERROR]         = { NULL,     NULL,   PREC_NONE       },
-	[TOKEN_EOF]           = { NULL,     NULL,   PREC_NONE       },
+	[TOKEN_LEFT_PAREN]    = { grouping, call,      PREC_CALL       },
+	[TOKEN_RIGHT_PAREN]   = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_LEFT_BRACE]    = { map,      NULL,      PREC_NONE       },
+	[TOKEN_RIGHT_BRACE]   = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_LEFT_BRACKET]  = { list,     subscript, PREC_CALL       },
+	[TOKEN_RIGHT_BRACKET] = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_COMMA]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_DOT]           = { NULL,     dot,       PREC_CALL       },
+	[TOKEN_COLON]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_MINUS]         = { unary,    binary,    PREC_TERM       },
+	[TOKEN_PLUS]          = { NULL,     binary,    PREC_TERM       },
+	[TOKEN_SEMICOLON]     = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_SLASH]         = { NULL,     binary,    PREC_FACTOR     },
+	[TOKEN_STAR]          = { NULL,     binary,    PREC_FACTOR     },
+	[TOKEN_BANG]          = { unary,    NULL,      PREC_NONE       },
+	[TOKEN_BANG_EQUAL]    = { NULL,     binary,    PREC_EQUALITY   },
+	[TOKEN_EQUAL]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_EQUAL_EQUAL]   = { NULL,     binary,    PREC_EQUALITY   },
+	[TOKEN_GREATER]       = { NULL,     binary,    PREC_COMPARISON },
+	[TOKEN_GREATER_EQUAL] = { NULL,     binary,    PREC_COMPARISON },
+	[TOKEN_LESS]          = { NULL,     binary,    PREC_COMPARISON },
+	[TOKEN_LESS_EQUAL]    = { NULL,     binary,    PREC_COMPARISON },
+	[TOKEN_IDENTIFIER]    = { variable, NULL,      PREC_NONE       },
+	[TOKEN_STRING]        = { string,   NULL,      PREC_NONE       },
+	[TOKEN_NUMBER]        = { number,   NULL,      PREC_NONE       },
+	[TOKEN_INTERPOLATION] = { template, NULL,      PREC_NONE       },
+	[TOKEN_AND]           = { NULL,     and,       PREC_AND        },
+	[TOKEN_CLASS]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_ELSE]          = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_FALSE]         = { literal,  NULL,      PREC_NONE       },
+	[TOKEN_FOR]           = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_FUN]           = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_IF]            = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_NIL]           = { literal,  NULL,      PREC_NONE       },
+	[TOKEN_OR]            = { NULL,     or,        PREC_OR         },
+	[TOKEN_PRINT]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_RETURN]        = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_SUPER]         = { super,    NULL,      PREC_NONE       },
+	[TOKEN_THIS]          = { this,     NULL,      PREC_NONE       },
+	[TOKEN_TRUE]          = { literal,  NULL,      PREC_NONE       },
+	[TOKEN_VAR]           = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_WHILE]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_ERROR]         = { NULL,     NULL,      PREC_NONE       },
+	[TOKEN_EOF]           = { NULL,     NULL,      PREC_NONE       },
 };
 
 static ParseRule* get_rule(TokenType type)
@@ -250,9 +259,11 @@ static uint8_t make_string_constant(Parser* parser, const char* chars, size_t le
 	if (!value_is_nil(index))
 		return (uint8_t)value_as_number(index);
 
-	// associate string with its created constant pool id
+	/* associate string with its created constant pool id, which every later
+	compilation reuses (as long as there was room for it in the pool) */
 	const uint8_t id = make_constant(parser, obj_value((Obj*)str));
-	table_put(&parser->data->strings, str, number_value(id));
+	if (value_array_size(&parser->data->constants) <= UINT8_MAX + 1)
+		table_put(&parser->data->strings, str, number_value(id));
 	return id;
 }
 
@@ -406,6 +417,9 @@ static void patch_jump(Parser* parser, int address)
 	// @NOTE: the Lox VM is big-endian
 	chunk_set_byte(current_chunk(parser), address, (stride >> 8) & 0xFF);
 	chunk_set_byte(current_chunk(parser), address + 1, stride & 0xFF);
+
+	// whatever came before now has a jump landing after it
+	parser->property_get = -1;
 }
 
 static void if_statement(Parser* parser)
@@ -430,7 +444,7 @@ static void if_statement(Parser* parser)
 	patch_jump(parser, else_jump);
 }
 
-static void emit_loop(Parser* parser, uint8_t target)
+static void emit_loop(Parser* parser, int target)
 {
 	emit_byte(parser, OP_LOOP); // like OP_JUMP, but jumps backwards
 
@@ -563,6 +577,7 @@ static void function(Parser* p, FunctionType type)
 
 	// restore enclosing compilation context and emit function obj definition
 	memswap(&p->compiler, &compiler, sizeof(Compiler));
+	p->property_get = -1; // that was an offset into the function's own chunk
 	emit_bytes(p, OP_CLOSURE, make_constant(p, obj_value((Obj*)function)));
 
 	// capture all upvalues compiled in the closure's compilation context
@@ -889,14 +904,28 @@ static void declaration(Parser* parser)
 
 static void number(Parser* parser, bool can_assign)
 {
-	const double value = strtod(parser->previous.start, NULL);
-	emit_bytes(parser, OP_CONSTANT, make_constant(parser, number_value(value)));
+	double value = 0;
+	const bool parsed = number_parse(parser->previous.start, parser->previous.length, &value);
+	assert(parsed); // the scanner only accepts valid numbers
+	(void)parsed;
+	emit_bytes(parser, OP_CONSTANT, make_constant(parser, number_value_compact(value)));
 }
 
 static void grouping(Parser* parser, bool can_assign)
 {
 	expression(parser);
 	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+
+	/* calling a grouped property get, as in "(obj.method)(args)", shouldn't bind
+	a method, so we turn it into an OP_GET_METHOD with an OP_CALL_METHOD */
+	Chunk* chunk = current_chunk(parser);
+	if (check(parser, TOKEN_LEFT_PAREN) && parser->property_get == chunk_size(chunk) - 2
+	    && chunk_get_byte(chunk, parser->property_get) == OP_GET_PROPERTY) {
+		chunk_set_byte(chunk, parser->property_get, OP_GET_METHOD);
+		advance(parser);
+		const uint8_t argc = argument_list(parser);
+		emit_bytes(parser, OP_CALL_METHOD, argc);
+	}
 }
 
 static void unary(Parser* parser, bool can_assign)
@@ -944,6 +973,49 @@ static void call(Parser* parser, bool can_assign)
 	emit_bytes(parser, OP_CALL, argc);
 }
 
+static void list(Parser* parser, bool can_assign)
+{
+	int count = 0;
+	if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+		do {
+			expression(parser);
+			++count;
+			if (count > 255) error(parser, "Cannot have more than 255 items in a list literal.");
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+	emit_bytes(parser, OP_BUILD_LIST, (uint8_t)count);
+}
+
+static void map(Parser* parser, bool can_assign)
+{
+	int count = 0;
+	if (!check(parser, TOKEN_RIGHT_BRACE)) {
+		do {
+			expression(parser);
+			consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+			expression(parser);
+			++count;
+			if (count > 255) error(parser, "Cannot have more than 255 entries in a map literal.");
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+	emit_bytes(parser, OP_BUILD_MAP, (uint8_t)count);
+}
+
+static void subscript(Parser* parser, bool can_assign)
+{
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+	if (can_assign && match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emit_byte(parser, OP_SET_INDEX);
+	} else {
+		emit_byte(parser, OP_GET_INDEX);
+	}
+}
+
 static void dot(Parser* parser, bool can_assign)
 {
 	consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
@@ -958,6 +1030,7 @@ static void dot(Parser* parser, bool can_assign)
 		emit_bytes(parser, OP_INVOKE, id);
 		emit_byte(parser, argc);
 	} else {
+		parser->property_get = chunk_size(current_chunk(parser));
 		emit_bytes(parser, OP_GET_PROPERTY, id);
 	}
 }
@@ -981,24 +1054,45 @@ static void string(Parser* parser, bool can_assign)
 	emit_bytes(parser, OP_CONSTANT, id);
 }
 
-static void register_string_constant(const ObjString* key, Value* val, void* p)
+/* Interpolated strings, like "a ${b} c", become their non-empty parts followed
+by a single OP_BUILD_STRING, so that the result is only allocated once. Each
+literal part comes in a token delimited by either '"' or '}' on the left, and
+either "${" or '"' on the right. */
+static void template(Parser* parser, bool can_assign)
 {
-	const uint8_t id = make_constant((Parser*)p, obj_value((Obj*)key));
-	*val = number_value(id);
+	int parts = 0;
+	do {
+		if (parser->previous.length > 3) {
+			const uint8_t id = make_string_constant(parser, parser->previous.start + 1,
+			                                                parser->previous.length - 3);
+			emit_bytes(parser, OP_CONSTANT, id);
+			++parts;
+		}
+		expression(parser);
+		++parts;
+	} while (match(parser, TOKEN_INTERPOLATION));
+
+	consume(parser, TOKEN_STRING, "Expect end of string interpolation.");
+	if (parser->previous.length > 2) {
+		const uint8_t id = make_string_constant(parser, parser->previous.start + 1,
+		                                                parser->previous.length - 2);
+		emit_bytes(parser, OP_CONSTANT, id);
+		++parts;
+	}
+
+	if (parts > UINT8_MAX) error(parser, "Too many parts in string interpolation.");
+	emit_bytes(parser, OP_BUILD_STRING, (uint8_t)parts);
 }
 
 ObjFunction* compile(const char* source, Environment* data)
 {
 	// begin compilation
-	Parser parser = { .error = false, .panic = false, .data = data };
+	Parser parser = { .error = false, .panic = false, .data = data, .property_get = -1 };
 	parser.class = NULL;
 	data->compiler = &parser.compiler;
 	compile_begin(&parser.compiler, TYPE_SCRIPT, NULL);
 	parser.compiler.subroutine = make_obj_function(data);
 
-	// register any previously interned strings into the chunk's constant pool
-	table_for_each(&data->strings, register_string_constant, &parser);
-
 	// setup scanner to have both .current and .next
 	scanner_start(&parser.scanner, source);
 	advance(&parser);
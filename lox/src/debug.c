@@ -88,7 +88,13 @@ int disassemble_instruction(const Chunk* chunk, const ValueArray* constants, int
 		CASE_BYTE(OP_SET_UPVALUE);
 		CASE_CONSTANT(OP_GET_PROPERTY);
 		CASE_CONSTANT(OP_SET_PROPERTY);
+		CASE_CONSTANT(OP_GET_METHOD);
 		CASE_CONSTANT(OP_GET_SUPER);
+		CASE_BYTE(OP_BUILD_LIST);
+		CASE_BYTE(OP_BUILD_MAP);
+		CASE_BYTE(OP_BUILD_STRING);
+		CASE_SIMPLE(OP_GET_INDEX);
+		CASE_SIMPLE(OP_SET_INDEX);
 		CASE_SIMPLE(OP_EQUAL);
 		CASE_SIMPLE(OP_GREATER);
 		CASE_SIMPLE(OP_LESS);
@@ -131,6 +137,7 @@ int disassemble_instruction(const Chunk* chunk, const ValueArray* constants, int
 		CASE_CONSTANT(OP_METHOD);
 		CASE_INVOKE(OP_INVOKE);
 		CASE_INVOKE(OP_SUPER_INVOKE);
+		CASE_BYTE(OP_CALL_METHOD);
 		CASE_SIMPLE(OP_INHERIT);
 		default: printf("Unknown opcode %d\n", instruction); return 1;
 	}
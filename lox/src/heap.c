@@ -0,0 +1,630 @@
+#define _POSIX_C_SOURCE 200112L // posix_memalign
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, MAP_NORESERVE, madvise
+
+#include "heap.h"
+
+#include <stdlib.h> // posix_memalign, malloc, free, qsort
+#include <string.h> // memset, memcpy
+#include <assert.h>
+#if HEAP_COMPRESSED_REFS
+#	include <sys/mman.h> // mmap, munmap, madvise
+#	include <unistd.h> // sysconf
+#endif
+
+#include <ugly/core.h> // byte_t, ARRAY_SIZE
+
+#include "common.h" // HEAP_PAGE_SIZE, uint64_t, uintptr_t
+
+
+// Small cells are multiples of this, which also sets their alignment.
+#define CELL_GRANULE 8
+#define SMALL_CLASSES 64
+#define SMALL_MAX (CELL_GRANULE * SMALL_CLASSES)
+
+// Bigger cells double in size, up to the point where a page holds very few.
+#define CELL_MAX (HEAP_PAGE_SIZE / 8)
+
+// Page blocks start with a pointer back to their descriptor, then come the cells.
+#define BLOCK_HEADER CELL_GRANULE
+
+#define WORD_BITS 64
+
+/* Page descriptors are allocated away from the blocks they describe, so that
+marking and sweeping only ever touch (and dirty) this metadata. */
+struct HeapPage {
+	struct HeapPage* next;
+	byte_t* block;
+	size_t block_size;
+	size_t cell_size;
+	size_t cell_count;
+	size_t words; // length of each bitmap
+	size_t free_hint; // first bitmap word which may have a free cell
+	bool evacuated; // whether cells now hold forwarding addresses
+	uint64_t bits[]; // allocation bitmap followed by the mark bitmap
+};
+
+
+static uint64_t* allocation_bits(struct HeapPage* page)
+{
+	return page->bits;
+}
+
+static uint64_t* mark_bits(struct HeapPage* page)
+{
+	return page->bits + page->words;
+}
+
+static int lowest_bit(uint64_t word)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(word);
+#else
+	int n = 0;
+	for (; (word & 1) == 0; word >>= 1) ++n;
+	return n;
+#endif
+}
+
+static int count_bits(uint64_t word)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(word);
+#else
+	int n = 0;
+	for (; word != 0; word &= word - 1) ++n;
+	return n;
+#endif
+}
+
+static size_t cell_index(const struct HeapPage* page, const struct Obj* object)
+{
+	return ((const byte_t*)object - (page->block + BLOCK_HEADER)) / page->cell_size;
+}
+
+static struct Obj* cell_at(const struct HeapPage* page, size_t index)
+{
+	return (struct Obj*)(page->block + BLOCK_HEADER + index * page->cell_size);
+}
+
+static size_t size_class(size_t size)
+{
+	if (size <= SMALL_MAX)
+		return size == 0 ? 0 : (size - 1) / CELL_GRANULE;
+
+	size_t class = SMALL_CLASSES;
+	for (size_t cell = 2 * SMALL_MAX; cell < size; cell *= 2)
+		++class;
+	return class;
+}
+
+static size_t class_cell_size(size_t class)
+{
+	return class < SMALL_CLASSES ? (class + 1) * CELL_GRANULE
+	                             : (size_t)SMALL_MAX << (class - SMALL_CLASSES + 1);
+}
+
+#if HEAP_COMPRESSED_REFS
+
+#define REGION_SIZE ((size_t)1 << 32)
+
+extern inline HeapRef heap_ref(const struct Obj* object);
+extern inline struct Obj* heap_deref(const struct Obj* holder, HeapRef ref);
+
+struct HeapSpan {
+	struct HeapSpan* next;
+	char* start;
+	size_t size;
+};
+
+static void arena_init(HeapArena* arena, char* start, size_t size, size_t granule)
+{
+	arena->top = start;
+	arena->end = start + size;
+	arena->granule = granule;
+	arena->free = NULL;
+}
+
+// Maps SIZE bytes of memory, preferably at HINT, or returns NULL.
+static char* region_map(char* hint, size_t size)
+{
+	// only touched pages are ever backed by memory, so this is mostly address space
+	char* map = mmap(hint, size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return map != MAP_FAILED ? map : NULL;
+}
+
+// Gets the start of the region aligned to its size which contains ADDRESS.
+static char* region_base(const char* address)
+{
+	return (char*)((uintptr_t)address & ~(uintptr_t)(REGION_SIZE - 1));
+}
+
+// Reserves the region of HEAP, returning false when there's no address space for it.
+static bool region_reserve(Heap* heap)
+{
+	/* the region must be aligned (so that its base is the high half of every
+	address in it), which it rarely is at first, but the mapping can usually be
+	moved down to the aligned address before it, since memory maps grow down */
+	char* base = region_map(NULL, REGION_SIZE);
+	if (base != NULL && base != region_base(base)) {
+		char* aligned = region_base(base);
+		munmap(base, REGION_SIZE);
+		base = region_map(aligned, REGION_SIZE);
+		if (base != aligned) {
+			if (base != NULL)
+				munmap(base, REGION_SIZE);
+
+			// otherwise, map twice as much, which surely contains an aligned region, and trim that
+			char* map = region_map(NULL, 2 * REGION_SIZE);
+			base = map != NULL ? region_base(map + REGION_SIZE - 1) : NULL;
+			if (base > map)
+				munmap(map, base - map);
+			if (base != NULL && base + REGION_SIZE < map + 2 * REGION_SIZE)
+				munmap(base + REGION_SIZE, map + 2 * REGION_SIZE - (base + REGION_SIZE));
+		}
+	}
+
+	if (base == NULL) {
+		heap->base = NULL;
+		arena_init(&heap->small, NULL, 0, HEAP_PAGE_SIZE);
+		arena_init(&heap->big, NULL, 0, HEAP_PAGE_SIZE);
+		return false;
+	}
+
+	const size_t half = REGION_SIZE / 2;
+	heap->base = base;
+	arena_init(&heap->small, base, half, HEAP_PAGE_SIZE);
+	arena_init(&heap->big, base + half, half, (size_t)sysconf(_SC_PAGESIZE));
+	return true;
+}
+
+static void region_release(Heap* heap)
+{
+	HeapArena* arenas[] = { &heap->small, &heap->big };
+	for (size_t i = 0; i < ARRAY_SIZE(arenas); ++i) {
+		while (arenas[i]->free != NULL) {
+			struct HeapSpan* next = arenas[i]->free->next;
+			free(arenas[i]->free);
+			arenas[i]->free = next;
+		}
+	}
+	if (heap->base != NULL)
+		munmap(heap->base, REGION_SIZE);
+	heap->base = NULL;
+}
+
+/* Pages of small cells fill whole HEAP_PAGE_SIZE blocks, aligned to that, while
+large objects only take as many OS pages as they need. */
+static HeapArena* arena_of(Heap* heap, size_t block_size)
+{
+	return block_size == HEAP_PAGE_SIZE ? &heap->small : &heap->big;
+}
+
+static bool is_large(const struct Obj* object)
+{
+	return ((uintptr_t)object & (REGION_SIZE - 1)) >= REGION_SIZE / 2;
+}
+
+static void* block_allocate(Heap* heap, size_t size)
+{
+	HeapArena* arena = arena_of(heap, size);
+	size = (size + arena->granule - 1) / arena->granule * arena->granule;
+
+	for (struct HeapSpan** link = &arena->free; *link != NULL; link = &(*link)->next) {
+		struct HeapSpan* span = *link;
+		if (span->size < size) continue;
+
+		char* block = span->start;
+		span->start += size;
+		span->size -= size;
+		if (span->size == 0) {
+			*link = span->next;
+			free(span);
+		}
+		return block;
+	}
+
+	if ((size_t)(arena->end - arena->top) < size)
+		return NULL;
+	char* block = arena->top;
+	arena->top += size;
+	return block;
+}
+
+static void block_free(Heap* heap, void* block, size_t size)
+{
+	HeapArena* arena = arena_of(heap, size);
+	size = (size + arena->granule - 1) / arena->granule * arena->granule;
+
+	// give the memory back, but keep the address range for later blocks
+	madvise(block, size, MADV_DONTNEED);
+	if ((char*)block + size == arena->top) {
+		arena->top = block;
+		return;
+	}
+
+	struct HeapSpan* span = malloc(sizeof(struct HeapSpan));
+	if (span == NULL)
+		return; // leaking address space is still better than crashing
+	span->start = block;
+	span->size = size;
+	span->next = arena->free;
+	arena->free = span;
+}
+
+#else
+
+static bool is_large(const struct Obj* object)
+{
+	return false; // large blocks are aligned just like pages
+}
+
+static void* block_allocate(Heap* heap, size_t size)
+{
+	void* block;
+	return posix_memalign(&block, HEAP_PAGE_SIZE, size) == 0 ? block : NULL;
+}
+
+static void block_free(Heap* heap, void* block, size_t size)
+{
+	free(block);
+}
+
+#endif // HEAP_COMPRESSED_REFS
+
+static struct HeapPage* page_of(const struct Obj* object)
+{
+	// large objects come right after the header of their block, wherever that is
+	const uintptr_t block = is_large(object) ? (uintptr_t)object - BLOCK_HEADER
+	                      : (uintptr_t)object & ~((uintptr_t)HEAP_PAGE_SIZE - 1);
+	return *(struct HeapPage**)block;
+}
+
+static struct HeapPage* page_create(Heap* heap, size_t cell_size, size_t cell_count, size_t block_size)
+{
+	const size_t words = (cell_count + WORD_BITS - 1) / WORD_BITS;
+	const size_t bitmaps = 2 * words * sizeof(uint64_t);
+	struct HeapPage* page = malloc(sizeof(struct HeapPage) + bitmaps);
+	if (page == NULL)
+		return NULL;
+
+	void* block = block_allocate(heap, block_size);
+	if (block == NULL) {
+		free(page);
+		return NULL;
+	}
+	*(struct HeapPage**)block = page;
+
+	page->next = NULL;
+	page->block = block;
+	page->block_size = block_size;
+	page->cell_size = cell_size;
+	page->cell_count = cell_count;
+	page->words = words;
+	page->free_hint = 0;
+	page->evacuated = false;
+	memset(page->bits, 0, bitmaps);
+	return page;
+}
+
+static void page_destroy(Heap* heap, struct HeapPage* page)
+{
+	block_free(heap, page->block, page->block_size);
+	free(page);
+}
+
+static struct Obj* page_allocate(struct HeapPage* page)
+{
+	uint64_t* allocated = allocation_bits(page);
+	for (size_t w = page->free_hint; w < page->words; ++w) {
+		const uint64_t free_cells = ~allocated[w];
+		if (free_cells == 0) continue;
+
+		const size_t index = w * WORD_BITS + lowest_bit(free_cells);
+		if (index >= page->cell_count) break; // padding bits in the last word
+
+		allocated[w] |= (uint64_t)1 << (index % WORD_BITS);
+		page->free_hint = w;
+		return cell_at(page, index);
+	}
+	page->free_hint = page->words;
+	return NULL;
+}
+
+void heap_init(Heap* heap)
+{
+	assert(size_class(CELL_MAX) < ARRAY_SIZE(heap->pages));
+	for (size_t i = 0; i < ARRAY_SIZE(heap->pages); ++i) {
+		heap->pages[i] = NULL;
+		heap->current[i] = NULL;
+	}
+	heap->large = NULL;
+	heap->evacuated = NULL;
+	heap->used = 0;
+	heap->capacity = 0;
+
+#if HEAP_COMPRESSED_REFS
+	// if this fails, allocations will too
+	region_reserve(heap);
+#endif
+}
+
+static void visit_page(struct HeapPage* page, HeapVisitor visit, void* forward)
+{
+	const uint64_t* allocated = allocation_bits(page);
+	for (size_t w = 0; w < page->words; ++w) {
+		for (uint64_t live = allocated[w]; live != 0; live &= live - 1)
+			visit(cell_at(page, w * WORD_BITS + lowest_bit(live)), forward);
+	}
+}
+
+static void destroy_pages(Heap* heap, struct HeapPage* page,
+                          HeapFinalizer finalize, void* forward)
+{
+	while (page != NULL) {
+		struct HeapPage* next = page->next;
+		visit_page(page, finalize, forward);
+		page_destroy(heap, page);
+		page = next;
+	}
+}
+
+void heap_destroy(Heap* heap, HeapFinalizer finalize, void* forward)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(heap->pages); ++i) {
+		destroy_pages(heap, heap->pages[i], finalize, forward);
+		heap->pages[i] = NULL;
+		heap->current[i] = NULL;
+	}
+	destroy_pages(heap, heap->large, finalize, forward);
+	heap->large = NULL;
+	heap_release_evacuated(heap);
+	heap->used = 0;
+	heap->capacity = 0;
+
+#if HEAP_COMPRESSED_REFS
+	region_release(heap);
+#endif
+}
+
+static struct Obj* allocate_large(Heap* heap, size_t size)
+{
+	const size_t cell_size = (size + CELL_GRANULE - 1) / CELL_GRANULE * CELL_GRANULE;
+	struct HeapPage* page = page_create(heap, cell_size, 1, BLOCK_HEADER + cell_size);
+	if (page == NULL)
+		return NULL;
+
+	page->next = heap->large;
+	heap->large = page;
+	return page_allocate(page);
+}
+
+struct Obj* heap_allocate(Heap* heap, size_t size)
+{
+	if (size > CELL_MAX)
+		return allocate_large(heap, size);
+
+	const size_t class = size_class(size);
+	for (struct HeapPage* page = heap->current[class]; page != NULL; page = page->next) {
+		struct Obj* cell = page_allocate(page);
+		if (cell != NULL) {
+			heap->current[class] = page;
+			heap->used += page->cell_size;
+			return cell;
+		}
+	}
+
+	// all pages of this size class are full, so we need a new one
+	const size_t cell_size = class_cell_size(class);
+	const size_t cell_count = (HEAP_PAGE_SIZE - BLOCK_HEADER) / cell_size;
+	struct HeapPage* page = page_create(heap, cell_size, cell_count, HEAP_PAGE_SIZE);
+	if (page == NULL)
+		return NULL;
+
+	page->next = heap->pages[class];
+	heap->pages[class] = page;
+	heap->current[class] = page;
+	heap->capacity += cell_size * cell_count;
+	heap->used += cell_size;
+	return page_allocate(page);
+}
+
+size_t heap_cell_size(const struct Obj* object)
+{
+	return page_of(object)->cell_size;
+}
+
+bool heap_mark(struct Obj* object)
+{
+	struct HeapPage* page = page_of(object);
+	const size_t index = cell_index(page, object);
+	uint64_t* word = &mark_bits(page)[index / WORD_BITS];
+	const uint64_t bit = (uint64_t)1 << (index % WORD_BITS);
+	const bool marked = (*word & bit) != 0;
+	*word |= bit;
+	return marked;
+}
+
+void heap_unmark(struct Obj* object)
+{
+	struct HeapPage* page = page_of(object);
+	const size_t index = cell_index(page, object);
+	mark_bits(page)[index / WORD_BITS] &= ~((uint64_t)1 << (index % WORD_BITS));
+}
+
+bool heap_is_marked(const struct Obj* object)
+{
+	struct HeapPage* page = page_of(object);
+	const size_t index = cell_index(page, object);
+	return (mark_bits(page)[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+}
+
+/* Sweeps a list of pages, unlinking and releasing those left empty. Returns
+the amount of bytes reclaimed from the objects which were not marked. */
+static size_t sweep_pages(Heap* heap, struct HeapPage** list, size_t* capacity,
+                          HeapFinalizer finalize, void* forward)
+{
+	size_t freed = 0;
+	while (*list != NULL) {
+		struct HeapPage* page = *list;
+		uint64_t* allocated = allocation_bits(page);
+		uint64_t* marks = mark_bits(page);
+
+		bool empty = true;
+		for (size_t w = 0; w < page->words; ++w) {
+			for (uint64_t dead = allocated[w] & ~marks[w]; dead != 0; dead &= dead - 1) {
+				finalize(cell_at(page, w * WORD_BITS + lowest_bit(dead)), forward);
+				freed += page->cell_size;
+			}
+			allocated[w] = marks[w];
+			marks[w] = 0;
+			empty = empty && allocated[w] == 0;
+		}
+
+		if (empty) {
+			*list = page->next;
+			*capacity -= page->cell_size * page->cell_count;
+			page_destroy(heap, page);
+		} else {
+			page->free_hint = 0;
+			list = &page->next;
+		}
+	}
+	return freed;
+}
+
+size_t heap_sweep(Heap* heap, HeapFinalizer finalize, void* forward)
+{
+	size_t freed = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(heap->pages); ++i) {
+		freed += sweep_pages(heap, &heap->pages[i], &heap->capacity, finalize, forward);
+		heap->current[i] = heap->pages[i];
+	}
+	heap->used -= freed;
+
+	size_t large_capacity = 0; // large objects are not accounted for in capacity
+	freed += sweep_pages(heap, &heap->large, &large_capacity, finalize, forward);
+	return freed;
+}
+
+static void visit_pages(struct HeapPage* page, HeapVisitor visit, void* forward)
+{
+	for (; page != NULL; page = page->next)
+		visit_page(page, visit, forward);
+}
+
+void heap_for_each(Heap* heap, HeapVisitor visit, void* forward)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(heap->pages); ++i)
+		visit_pages(heap->pages[i], visit, forward);
+	visit_pages(heap->large, visit, forward);
+}
+
+struct page_load {
+	struct HeapPage* page;
+	size_t live;
+};
+
+static int by_decreasing_load(const void* a, const void* b)
+{
+	const size_t x = ((const struct page_load*)a)->live;
+	const size_t y = ((const struct page_load*)b)->live;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Packs the live cells in a list of pages into as few of them as possible.
+static size_t evacuate_pages(Heap* heap, size_t class, HeapMover moved, void* forward)
+{
+	size_t n = 0;
+	for (struct HeapPage* page = heap->pages[class]; page != NULL; page = page->next)
+		++n;
+	if (n < 2)
+		return 0;
+
+	struct page_load* loads = malloc(n * sizeof(struct page_load));
+	if (loads == NULL)
+		return 0; // compaction is just an optimization, so we can give up
+
+	size_t live = 0;
+	size_t i = 0;
+	for (struct HeapPage* page = heap->pages[class]; page != NULL; page = page->next, ++i) {
+		const uint64_t* allocated = allocation_bits(page);
+		loads[i].page = page;
+		loads[i].live = 0;
+		for (size_t w = 0; w < page->words; ++w)
+			loads[i].live += count_bits(allocated[w]);
+		live += loads[i].live;
+	}
+
+	// the densest pages are kept, while the rest gets moved into their holes
+	const size_t cells_per_page = loads[0].page->cell_count;
+	const size_t kept = (live + cells_per_page - 1) / cells_per_page;
+	if (kept >= n) {
+		free(loads);
+		return 0;
+	}
+	qsort(loads, n, sizeof(struct page_load), by_decreasing_load);
+
+	heap->pages[class] = NULL;
+	for (i = kept; i-- > 0;) {
+		loads[i].page->next = heap->pages[class];
+		heap->pages[class] = loads[i].page;
+	}
+	heap->current[class] = heap->pages[class];
+
+	size_t moves = 0;
+	size_t target = 0;
+	for (i = kept; i < n; ++i) {
+		struct HeapPage* source = loads[i].page;
+		const uint64_t* allocated = allocation_bits(source);
+		for (size_t w = 0; w < source->words; ++w) {
+			for (uint64_t cells = allocated[w]; cells != 0; cells &= cells - 1) {
+				struct Obj* from = cell_at(source, w * WORD_BITS + lowest_bit(cells));
+				struct Obj* to;
+				while ((to = page_allocate(loads[target].page)) == NULL)
+					++target;
+				memcpy(to, from, source->cell_size);
+				moved(to, from, forward);
+				*(struct Obj**)from = to; // leave a forwarding address behind
+				++moves;
+			}
+		}
+		source->evacuated = true;
+		source->next = heap->evacuated;
+		heap->evacuated = source;
+		heap->capacity -= source->cell_size * source->cell_count;
+	}
+
+	free(loads);
+	return moves;
+}
+
+size_t heap_evacuate(Heap* heap, HeapMover moved, void* forward)
+{
+	size_t moves = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(heap->pages); ++i)
+		moves += evacuate_pages(heap, i, moved, forward);
+	return moves;
+}
+
+struct Obj* heap_forward(struct Obj* object)
+{
+	return page_of(object)->evacuated ? *(struct Obj**)object : object;
+}
+
+void heap_release_evacuated(Heap* heap)
+{
+	while (heap->evacuated != NULL) {
+		struct HeapPage* next = heap->evacuated->next;
+		page_destroy(heap, heap->evacuated);
+		heap->evacuated = next;
+	}
+}
+
+#undef REGION_SIZE
+#undef WORD_BITS
+#undef BLOCK_HEADER
+#undef CELL_MAX
+#undef SMALL_MAX
+#undef SMALL_CLASSES
+#undef CELL_GRANULE
@@ -0,0 +1,271 @@
+#include "kernels.h"
+
+#include <stdlib.h> // qsort
+#include <math.h> // NAN, isnan
+
+#include "common.h" // SIMD_KERNELS
+
+#if SIMD_KERNELS
+#	include <immintrin.h>
+#	define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+
+
+// Plain loops, which the SIMD versions also use for their leftover items.
+
+static double scalar_sum(const double* a, size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum += a[i];
+	return sum;
+}
+
+static double scalar_dot(const double* a, const double* b, size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+static void scalar_scale(double* a, double k, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		a[i] *= k;
+}
+
+static void scalar_add(double* a, const double* b, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		a[i] += b[i];
+}
+
+// Combines PARTIAL, which may be NaN, with the minimum of the N (maybe zero) items in A.
+static double scalar_min_from(double partial, const double* a, size_t n)
+{
+	double min = partial;
+	for (size_t i = 0; i < n; ++i) {
+		if (isnan(a[i])) return NAN;
+		else if (a[i] < min) min = a[i];
+	}
+	return isnan(min) ? NAN : min;
+}
+
+static double scalar_max_from(double partial, const double* a, size_t n)
+{
+	double max = partial;
+	for (size_t i = 0; i < n; ++i) {
+		if (isnan(a[i])) return NAN;
+		else if (a[i] > max) max = a[i];
+	}
+	return isnan(max) ? NAN : max;
+}
+
+static double scalar_min(const double* a, size_t n)
+{
+	return scalar_min_from(a[0], a + 1, n - 1);
+}
+
+static double scalar_max(const double* a, size_t n)
+{
+	return scalar_max_from(a[0], a + 1, n - 1);
+}
+
+#if SIMD_KERNELS
+
+// SSE2, two doubles at a time, with two accumulators to hide the latency of additions.
+
+TARGET("sse2") static double sse2_sum(const double* a, size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+		acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+	return lanes[0] + lanes[1] + scalar_sum(a + i, n - i);
+}
+
+TARGET("sse2") static double sse2_dot(const double* a, const double* b, size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+	return lanes[0] + lanes[1] + scalar_dot(a + i, b + i, n - i);
+}
+
+TARGET("sse2") static void sse2_scale(double* a, double k, size_t n)
+{
+	const __m128d factor = _mm_set1_pd(k);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+	scalar_scale(a + i, k, n - i);
+}
+
+TARGET("sse2") static void sse2_add(double* a, const double* b, size_t n)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	scalar_add(a + i, b + i, n - i);
+}
+
+// NaNs are tracked apart, since minpd and maxpd don't propagate them consistently.
+TARGET("sse2") static double sse2_min(const double* a, size_t n)
+{
+	__m128d min = _mm_set1_pd(a[0]), nans = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		const __m128d x = _mm_loadu_pd(a + i);
+		min = _mm_min_pd(min, x);
+		nans = _mm_or_pd(nans, _mm_cmpunord_pd(x, x));
+	}
+	if (_mm_movemask_pd(nans)) return NAN;
+	double lanes[2];
+	_mm_storeu_pd(lanes, min);
+	return scalar_min_from(lanes[0] < lanes[1] ? lanes[0] : lanes[1], a + i, n - i);
+}
+
+TARGET("sse2") static double sse2_max(const double* a, size_t n)
+{
+	__m128d max = _mm_set1_pd(a[0]), nans = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		const __m128d x = _mm_loadu_pd(a + i);
+		max = _mm_max_pd(max, x);
+		nans = _mm_or_pd(nans, _mm_cmpunord_pd(x, x));
+	}
+	if (_mm_movemask_pd(nans)) return NAN;
+	double lanes[2];
+	_mm_storeu_pd(lanes, max);
+	return scalar_max_from(lanes[0] > lanes[1] ? lanes[0] : lanes[1], a + i, n - i);
+}
+
+// AVX2, four doubles at a time, otherwise just like the above.
+
+TARGET("avx2") static double avx2_sum(const double* a, size_t n)
+{
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+		acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + scalar_sum(a + i, n - i);
+}
+
+TARGET("avx2") static double avx2_dot(const double* a, const double* b, size_t n)
+{
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + scalar_dot(a + i, b + i, n - i);
+}
+
+TARGET("avx2") static void avx2_scale(double* a, double k, size_t n)
+{
+	const __m256d factor = _mm256_set1_pd(k);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+	scalar_scale(a + i, k, n - i);
+}
+
+TARGET("avx2") static void avx2_add(double* a, const double* b, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	scalar_add(a + i, b + i, n - i);
+}
+
+TARGET("avx2") static double avx2_min(const double* a, size_t n)
+{
+	__m256d min = _mm256_set1_pd(a[0]), nans = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m256d x = _mm256_loadu_pd(a + i);
+		min = _mm256_min_pd(min, x);
+		nans = _mm256_or_pd(nans, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+	}
+	if (_mm256_movemask_pd(nans)) return NAN;
+	double lanes[4];
+	_mm256_storeu_pd(lanes, min);
+	return scalar_min_from(scalar_min(lanes, 4), a + i, n - i);
+}
+
+TARGET("avx2") static double avx2_max(const double* a, size_t n)
+{
+	__m256d max = _mm256_set1_pd(a[0]), nans = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m256d x = _mm256_loadu_pd(a + i);
+		max = _mm256_max_pd(max, x);
+		nans = _mm256_or_pd(nans, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+	}
+	if (_mm256_movemask_pd(nans)) return NAN;
+	double lanes[4];
+	_mm256_storeu_pd(lanes, max);
+	return scalar_max_from(scalar_max(lanes, 4), a + i, n - i);
+}
+
+static const Kernels sse2_kernels = {
+	sse2_sum, sse2_dot, sse2_scale, sse2_add, sse2_min, sse2_max,
+};
+
+static const Kernels avx2_kernels = {
+	avx2_sum, avx2_dot, avx2_scale, avx2_add, avx2_min, avx2_max,
+};
+
+#endif // SIMD_KERNELS
+
+static const Kernels scalar_kernels = {
+	scalar_sum, scalar_dot, scalar_scale, scalar_add, scalar_min, scalar_max,
+};
+
+const Kernels* kernels_select(void)
+{
+#if SIMD_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &avx2_kernels;
+	else if (__builtin_cpu_supports("sse2"))
+		return &sse2_kernels;
+#endif
+	return &scalar_kernels;
+}
+
+static int compare_f64(const void* a, const void* b)
+{
+	const double x = *(const double*)a;
+	const double y = *(const double*)b;
+	if (isnan(x) || isnan(y))
+		return (isnan(x) != 0) - (isnan(y) != 0);
+	return (x > y) - (x < y);
+}
+
+void f64_sort(double* a, size_t n)
+{
+	qsort(a, n, sizeof(double), compare_f64);
+}
+
+#if SIMD_KERNELS
+#	undef TARGET
+#endif
@@ -0,0 +1,202 @@
+#include "map.h"
+
+#include <string.h> // memset, memcpy
+#include <assert.h>
+
+#include "object.h" // ObjString, obj_string_hash, ObjBoundMethod
+#include "common.h" // NULL, uint64_t, int32_t, uintptr_t
+#include "memory.h" // reallocate
+
+
+struct MapEntry {
+	Value key;
+	Value value;
+	hash_t hash;
+	bool deleted;
+};
+
+#define MIN_CAPACITY 8
+
+// Index slots hold positions in the entries array, or one of these.
+#define SLOT_EMPTY (-1)
+#define SLOT_DELETED (-2)
+
+
+// Entries only take up to 3/4 of the index, so that probe sequences stay short.
+static int max_entries(int capacity)
+{
+	return capacity / 4 * 3;
+}
+
+static size_t allocation_size(int capacity)
+{
+	return max_entries(capacity) * sizeof(struct MapEntry) + capacity * sizeof(int32_t);
+}
+
+// Final mix of MurmurHash3, so that nearby numbers and addresses spread out.
+static hash_t mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return (uint32_t)x;
+}
+
+static hash_t hash_value(Value key)
+{
+	if (value_is_int(key)) {
+		return mix((uint64_t)value_as_int(key));
+	} else if (value_is_number(key)) {
+		// integral doubles (and -0) must hash just like the equal ints
+		const double number = value_as_number(key);
+		if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number)
+			return mix((uint64_t)(int32_t)number);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		return mix(bits);
+	} else if (value_is_string(key)) {
+		return obj_string_hash(value_as_string(key));
+	} else if (value_is_method(key)) {
+		// equal bound methods must hash the same, so this only depends on what they hold
+		const ObjBoundMethod* bound = value_as_method(key);
+		const uint64_t receiver = hash_value(bound->receiver);
+		return mix(receiver << 32 | hash_value(obj_value((Obj*)bound->method)));
+	} else if (value_is_obj(key)) {
+		// other objects get a hash the first time they're used as keys
+		Obj* object = value_as_obj(key);
+		if (object->hash == 0)
+			object->hash = mix((uintptr_t)object) | 1;
+		return object->hash;
+	} else {
+		return value_is_nil(key) ? mix(1) : mix(value_as_bool(key) ? 2 : 3);
+	}
+}
+
+// Finds the index slot for KEY, or the one where it would be inserted.
+static int32_t* find_slot(const ValueMap* map, Value key, hash_t hash)
+{
+	const int mask = map->capacity - 1;
+	int32_t* tombstone = NULL;
+	for (int i = hash & mask;; i = (i + 1) & mask) {
+		int32_t* slot = &map->index[i];
+		if (*slot == SLOT_EMPTY) {
+			return tombstone != NULL ? tombstone : slot;
+		} else if (*slot == SLOT_DELETED) {
+			if (tombstone == NULL) tombstone = slot;
+		} else {
+			const struct MapEntry* entry = &map->entries[*slot];
+			if (entry->hash == hash && value_equal(entry->key, key))
+				return slot;
+		}
+	}
+}
+
+static const struct MapEntry* find_entry(const ValueMap* map, Value key)
+{
+	if (map->count == 0) return NULL;
+	const int32_t* slot = find_slot(map, key, hash_value(key));
+	return *slot >= 0 ? &map->entries[*slot] : NULL;
+}
+
+// Moves live entries into new arrays, with room for about as many more.
+static void rehash(ValueMap* map)
+{
+	int capacity = MIN_CAPACITY;
+	while (max_entries(capacity) < 2 * (map->count + 1))
+		capacity *= 2;
+
+	// may trigger the GC, which only reads the old arrays
+	struct MapEntry* entries = reallocate(map->env, NULL, allocation_size(capacity), "ValueMap");
+
+	ValueMap old = *map;
+	map->entries = entries;
+	map->index = (int32_t*)(entries + max_entries(capacity));
+	map->capacity = capacity;
+	map->used = 0;
+	memset(map->index, 0xFF, capacity * sizeof(int32_t)); // all SLOT_EMPTY
+
+	const int mask = capacity - 1;
+	for (int e = 0; e < old.used; ++e) {
+		if (old.entries[e].deleted) continue;
+		int i = old.entries[e].hash & mask;
+		while (map->index[i] != SLOT_EMPTY)
+			i = (i + 1) & mask;
+		map->index[i] = map->used;
+		map->entries[map->used++] = old.entries[e];
+	}
+
+	reallocate(map->env, old.entries, 0, "ValueMap");
+}
+
+void value_map_init(ValueMap* map, Environment* env)
+{
+	*map = (ValueMap){ .env = env };
+}
+
+void value_map_destroy(ValueMap* map)
+{
+	reallocate(map->env, map->entries, 0, "ValueMap");
+	value_map_init(map, map->env);
+}
+
+bool value_map_get(const ValueMap* map, Value key, Value* value)
+{
+	const struct MapEntry* entry = find_entry(map, key);
+	if (entry == NULL) return false;
+	*value = entry->value;
+	return true;
+}
+
+bool value_map_put(ValueMap* map, Value key, Value value)
+{
+	assert(!value_is_rope(key));
+	const hash_t hash = hash_value(key);
+	if (map->capacity > 0) {
+		const int32_t* slot = find_slot(map, key, hash);
+		if (*slot >= 0) {
+			map->entries[*slot].value = value;
+			return true;
+		}
+	}
+
+	// new entries always go at the end, which may need a rehash to drop holes
+	if (map->capacity == 0 || map->used >= max_entries(map->capacity))
+		rehash(map);
+
+	int32_t* slot = find_slot(map, key, hash);
+	*slot = map->used;
+	map->entries[map->used++] = (struct MapEntry){ .key = key, .value = value, .hash = hash };
+	map->count++;
+	return false;
+}
+
+bool value_map_delete(ValueMap* map, Value key, Value* value)
+{
+	if (map->count == 0) return false;
+	int32_t* slot = find_slot(map, key, hash_value(key));
+	if (*slot < 0) return false;
+
+	struct MapEntry* entry = &map->entries[*slot];
+	if (value != NULL) *value = entry->value;
+	entry->deleted = true;
+	entry->key = nil_value();
+	entry->value = nil_value();
+	*slot = SLOT_DELETED;
+	map->count--;
+	return true;
+}
+
+void value_map_for_each(ValueMap* map, void (*func)(Value*, Value*, void*), void* forward)
+{
+	for (int e = 0; e < map->used; ++e) {
+		struct MapEntry* entry = &map->entries[e];
+		if (!entry->deleted)
+			func(&entry->key, &entry->value, forward);
+	}
+}
+
+#undef SLOT_DELETED
+#undef SLOT_EMPTY
+#undef MIN_CAPACITY
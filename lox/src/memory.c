@@ -2,15 +2,18 @@
 
 #include <stdlib.h> // malloc, free, realloc, exit
 #include <stdio.h>
+#include <string.h> // memset
 #include <assert.h>
 
 #include <ugly/stack.h>
 #include <ugly/core.h> // byte_t, containerof
 
 #include "vm.h"
-#include "common.h" // DEBUG_LOG_GC
+#include "heap.h"
+#include "common.h" // DEBUG_LOG_GC, GC_COMPACTION
 #include "value.h"
 #include "object.h"
+#include "map.h" // value_map_for_each
 #include "compiler.h" // Compiler
 
 
@@ -83,29 +86,54 @@ static void* sized_realloc(Environment* env, void* ptr, size_t size, const char*
 
 void* reallocate(Environment* env, void* ptr, size_t size, const char* why)
 {
+	/* only invoke GC before allocations: containers being resized are still in
+	a consistent state by then, and frees may come from the sweep itself */
+#if DEBUG_STRESS_GC
+	if (size != 0 && !env->collecting)
+		collect_garbage(env);
+#else
+	if (size != 0 && !env->collecting && env->allocated + size > env->next_gc)
+		collect_garbage(env);
+#endif
+
 	void* mem = sized_realloc(env, ptr, size, why);
 	if (size != 0 && mem == NULL) {
 		fprintf(stderr, "Out of memory for '%s'!\n", why);
 		exit(74);
 	}
 
+	return mem;
+}
+
+Obj* allocate_cell(Environment* env, size_t size, const char* why)
+{
+	// as above, but here it also keeps the new cell from being swept
 #if DEBUG_STRESS_GC
-	if (size != 0) // only invoke GC on allocations
-		collect_garbage(env);
+	collect_garbage(env);
 #else
-	if (env->allocated > env->next_gc)
+	if (env->allocated + size > env->next_gc)
 		collect_garbage(env);
 #endif
 
-	return mem;
+	Obj* cell = heap_allocate(&env->heap, size);
+	if (cell == NULL) {
+		fprintf(stderr, "Out of memory for '%s'!\n", why);
+		exit(74);
+	}
+
+	env->allocated += heap_cell_size(cell);
+#if DEBUG_LOG_GC
+	printf("%p allocate %ld for %s\n", (void*)cell, heap_cell_size(cell), why);
+#endif
+
+	return cell;
 }
 
 static void mark_object(Environment* env, Obj* object)
 {
-	if (object == NULL || object->marked)
+	if (object == NULL || heap_mark(object))
 		return;
 
-	object->marked = true;
 #if DEBUG_LOG_GC
 	printf("%p mark ", object);
 	value_print(obj_value(object));
@@ -113,7 +141,8 @@ static void mark_object(Environment* env, Obj* object)
 #endif
 
 	// objects which don't hold references don't need to be traced
-	if (object->type == OBJ_NATIVE || object->type == OBJ_STRING)
+	if (object->type == OBJ_NATIVE || object->type == OBJ_STRING
+	    || object->type == OBJ_FLOAT64_ARRAY || object->type == OBJ_FILE)
 		return;
 	else
 		stack_push(&env->grays, &object);
@@ -132,6 +161,13 @@ static void mark_each(const ObjString* key, Value* value, void* env_ptr)
 	mark_value(env, *value);
 }
 
+static void mark_map_entry(Value* key, Value* value, void* env_ptr)
+{
+	Environment* env = (Environment*)env_ptr;
+	mark_value(env, *key);
+	mark_value(env, *value);
+}
+
 static void mark_roots(Environment* env)
 {
 	// locals
@@ -170,17 +206,24 @@ static void blacken_object(Environment* env, Obj* object)
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
 			mark_object(env, (Obj*)closure->function);
-			for (int i = 0; i < closure->upvalue_count; ++i)
+			for (int i = 0; i < closure->function->upvalues; ++i)
 				mark_object(env, (Obj*)closure->upvalues[i]);
 			break;
 		}
 		case OBJ_FUNCTION:
 			mark_object(env, (Obj*)((ObjFunction*)object)->name);
 			break;
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			mark_object(env, heap_deref(object, rope->left));
+			mark_object(env, heap_deref(object, rope->right));
+			mark_object(env, heap_deref(object, rope->flat));
+			break;
+		}
 		case OBJ_UPVALUE:
 			mark_value(env, ((ObjUpvalue*)object)->closed);
 			break;
-		case OBJ_NATIVE: case OBJ_STRING:
+		case OBJ_NATIVE: case OBJ_STRING: case OBJ_FLOAT64_ARRAY: case OBJ_FILE:
 			break;
 		case OBJ_CLASS: {
 			ObjClass* class = (ObjClass*)object;
@@ -188,10 +231,27 @@ static void blacken_object(Environment* env, Obj* object)
 			table_for_each(&class->methods, mark_each, env);
 			break;
 		}
+		case OBJ_LIST: {
+			const ObjList* list = (ObjList*)object;
+			for (int i = 0; i < list->count; ++i)
+				mark_value(env, list->items[i]);
+			break;
+		}
+		case OBJ_MAP:
+			value_map_for_each(&((ObjMap*)object)->map, mark_map_entry, env);
+			break;
+		case OBJ_BYTES:
+			mark_object(env, heap_deref(object, ((ObjBytes*)object)->owner));
+			break;
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
-			mark_object(env, (Obj*)instance->class);
-			table_for_each(&instance->fields, mark_each, env);
+			mark_object(env, heap_deref(object, instance->class));
+			for (int i = 0; i < obj_instance_inline_count(instance); ++i) {
+				mark_object(env, heap_deref(object, instance->names[i]));
+				mark_value(env, instance->values[i]);
+			}
+			if (instance->fields != NULL)
+				table_for_each(instance->fields, mark_each, env);
 			break;
 		}
 		case OBJ_BOUND_METHOD: {
@@ -216,34 +276,22 @@ static void trace_references(Environment* env)
 	}
 }
 
+static void free_white(Obj* object, void* env)
+{
+#if DEBUG_LOG_GC
+	printf("%p free %ld for type %d\n", (void*)object, heap_cell_size(object), object->type);
+#endif
+	free_obj((Environment*)env, object);
+}
+
 static void sweep(Environment* env)
 {
-	Obj* previous = NULL;
-	Obj* object = env->objects;
-	while (object != NULL) {
-		if (object->marked) {
-			object->marked = false;
-			previous = object;
-			object = object->next;
-		} else {
-			Obj* white = object;
-			free_obj(env, white);
-			object = object->next;
-			if (previous != NULL)
-				previous->next = object;
-			else
-				env->objects = object;
-		}
-	}
+	env->allocated -= heap_sweep(&env->heap, free_white, env);
 }
 
-static void remove_each_white(const ObjString* key, Value* value, void* table_ptr)
+static bool is_white(const ObjString* key, Value* value, void* forward)
 {
-	Table* table = (Table*)table_ptr;
-	if (!key->obj.marked)
-		table_delete(table, key);
-	/* @NOTE: modifying the table while iterating through it is dangerous, this
-	only works because we know the implementation of table_delete/map_remove */
+	return !heap_is_marked(&key->obj);
 }
 
 void collect_garbage(Environment *env)
@@ -253,12 +301,29 @@ void collect_garbage(Environment *env)
 	const size_t before = env->allocated;
 #endif
 
+	// methods are only cached while nothing can move or die
+	memset(env->vm->bound_methods, 0, sizeof(env->vm->bound_methods));
+	memset(env->vm->method_cache.entries, 0, sizeof(env->vm->method_cache.entries));
+
 	mark_roots(env);
 	trace_references(env);
-	table_for_each(&env->strings, remove_each_white, &env->strings);
+	table_delete_if(&env->strings, is_white, NULL);
 	sweep(env);
 	env->next_gc = env->allocated * 2; // GC heap grow factor
 
+	// the intern table is weak, so this is where it may get sparse
+	env->collecting = true;
+	table_shrink(&env->strings);
+	env->collecting = false;
+
+#if GC_COMPACTION
+	// compaction must wait for a safe point, so we just ask for it
+	const Heap* heap = &env->heap;
+	if (heap->capacity > GC_HEAP_INITIAL
+	    && heap->used < heap->capacity / 100 * GC_COMPACT_OCCUPANCY)
+		env->compaction_pending = true;
+#endif
+
 #if DEBUG_LOG_GC
 	printf("-- gc end\n");
 	const size_t after = env->allocated;
@@ -266,3 +331,171 @@ void collect_garbage(Environment *env)
 	       before - after, before, after, env->next_gc);
 #endif
 }
+
+static Value forward_value(Value value)
+{
+	return value_is_obj(value) ? obj_value(heap_forward(value_as_obj(value))) : value;
+}
+
+static Obj* forward_object(Obj* object)
+{
+	return object != NULL ? heap_forward(object) : NULL;
+}
+
+// Updates REF, which is stored in HOLDER, for any object that has been moved.
+static HeapRef forward_ref(const Obj* holder, HeapRef ref)
+{
+	return heap_ref(forward_object(heap_deref(holder, ref)));
+}
+
+static void relocate_object(Obj* to, const Obj* from, void* env)
+{
+	// closed upvalues point to their own storage, which has just moved
+	if (to->type == OBJ_UPVALUE) {
+		ObjUpvalue* upvalue = (ObjUpvalue*)to;
+		if (upvalue->location == &((const ObjUpvalue*)from)->closed)
+			upvalue->location = &upvalue->closed;
+	}
+}
+
+static void forward_each(ObjString** key, Value* value, void* env)
+{
+	*key = (ObjString*)heap_forward((Obj*)*key);
+	*value = forward_value(*value);
+}
+
+static void forward_map_entry(Value* key, Value* value, void* env)
+{
+	// identity hashes live in the object headers, so they move along with them
+	*key = forward_value(*key);
+	*value = forward_value(*value);
+}
+
+static void forward_roots(Environment* env)
+{
+	// locals
+	for (Value* slot = env->vm->stack; slot < env->vm->stack_pointer; slot++)
+		*slot = forward_value(*slot);
+
+	// upvalues
+	env->open_upvalues = (ObjUpvalue*)forward_object((Obj*)env->open_upvalues);
+
+	// globals
+	table_for_each_entry(&env->globals, forward_each, env);
+	env->vm->init_string = (ObjString*)forward_object((Obj*)env->vm->init_string);
+
+	// call frames
+	for (int i = 0; i < env->vm->frame_count; ++i) {
+		CallFrame* frame = &env->vm->frames[i];
+		frame->subroutine = (ObjClosure*)heap_forward((Obj*)frame->subroutine);
+	}
+
+	// static data
+	for (int i = 0, n = value_array_size(&env->constants); i < n; ++i)
+		value_array_set(&env->constants, i, forward_value(value_array_get(&env->constants, i)));
+
+	// compilation data
+	for (Compiler* current = env->compiler; current != NULL; current = current->enclosing)
+		current->subroutine = (ObjFunction*)forward_object((Obj*)current->subroutine);
+
+	// interned strings
+	table_for_each_entry(&env->strings, forward_each, env);
+}
+
+static void forward_fields(Obj* object, void* env)
+{
+	switch (object->type) {
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			closure->function = (ObjFunction*)heap_forward((Obj*)closure->function);
+			for (int i = 0; i < closure->function->upvalues; ++i)
+				closure->upvalues[i] = (ObjUpvalue*)forward_object((Obj*)closure->upvalues[i]);
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*)object;
+			function->name = (ObjString*)forward_object((Obj*)function->name);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			rope->left = forward_ref(object, rope->left);
+			rope->right = forward_ref(object, rope->right);
+			rope->flat = forward_ref(object, rope->flat);
+			break;
+		}
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = (ObjUpvalue*)object;
+			upvalue->closed = forward_value(upvalue->closed);
+			// only open upvalues are linked, closed ones may have stale pointers
+			if (upvalue->location != &upvalue->closed)
+				upvalue->next = (ObjUpvalue*)forward_object((Obj*)upvalue->next);
+			break;
+		}
+		case OBJ_NATIVE: case OBJ_STRING: case OBJ_FLOAT64_ARRAY: case OBJ_FILE:
+			break;
+		case OBJ_CLASS: {
+			ObjClass* class = (ObjClass*)object;
+			class->name = (ObjString*)heap_forward((Obj*)class->name);
+			table_for_each_entry(&class->methods, forward_each, env);
+			for (int i = 0; i < class->vtable_size; ++i)
+				class->vtable[i] = (ObjClosure*)forward_object((Obj*)class->vtable[i]);
+			break;
+		}
+		case OBJ_LIST: {
+			ObjList* list = (ObjList*)object;
+			for (int i = 0; i < list->count; ++i)
+				list->items[i] = forward_value(list->items[i]);
+			break;
+		}
+		case OBJ_MAP:
+			value_map_for_each(&((ObjMap*)object)->map, forward_map_entry, env);
+			break;
+		case OBJ_BYTES: {
+			ObjBytes* bytes = (ObjBytes*)object;
+			bytes->owner = forward_ref(object, bytes->owner);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)object;
+			instance->class = forward_ref(object, instance->class);
+			for (int i = 0; i < obj_instance_inline_count(instance); ++i) {
+				instance->names[i] = forward_ref(object, instance->names[i]);
+				instance->values[i] = forward_value(instance->values[i]);
+			}
+			if (instance->fields != NULL)
+				table_for_each_entry(instance->fields, forward_each, env);
+			break;
+		}
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			bound->receiver = forward_value(bound->receiver);
+			bound->method = (ObjClosure*)heap_forward((Obj*)bound->method);
+			break;
+		}
+		default:
+			fprintf(stderr, "Invalid object type %d during GC compaction.\n", object->type);
+			assert(false);
+	}
+}
+
+void compact_garbage(Environment *env)
+{
+	collect_garbage(env);
+	env->compaction_pending = false;
+
+#if DEBUG_LOG_GC
+	printf("-- gc compact\n");
+#endif
+
+	const size_t moves = heap_evacuate(&env->heap, relocate_object, env);
+	if (moves > 0) {
+		forward_roots(env);
+		heap_for_each(&env->heap, forward_fields, env);
+		heap_release_evacuated(&env->heap);
+	}
+
+#if DEBUG_LOG_GC
+	printf("   moved %ld objects\n", moves);
+#endif
+}
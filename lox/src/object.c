@@ -1,19 +1,27 @@
 #include "object.h"
 
 #include <stdio.h>
-#include <string.h> // memcpy
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, memcmp, memmove, memset
 #include <stddef.h> // size_t
 #include <assert.h>
 
+#include <ugly/stack.h>
+
 #include "table.h"
 #include "chunk.h"
-#include "memory.h" // reallocate
+#include "memory.h" // reallocate, allocate_cell
+#include "heap.h"
+#include "output.h"
+#include "common.h" // FILE_BUFFER_SIZE
 
 
 extern inline ObjType obj_type(Value value);
 
 extern inline bool value_obj_is_type(Value value, ObjType type);
 extern inline bool value_is_string(Value value);
+extern inline bool value_is_rope(Value value);
+extern inline bool value_is_string_or_rope(Value value);
 extern inline bool value_is_function(Value value);
 extern inline bool value_is_closure(Value value);
 extern inline bool value_is_native(Value value);
@@ -23,48 +31,239 @@ extern inline bool value_is_method(Value value);
 
 extern inline ObjString* value_as_string(Value value);
 extern inline char* value_as_c_str(Value value);
+extern inline ObjRope* value_as_rope(Value value);
+extern inline hash_t obj_string_hash(const ObjString* string);
+extern inline ObjClosure* obj_class_dispatch(const ObjClass* class, int selector);
+extern inline ObjClass* obj_instance_class(const ObjInstance* instance);
+extern inline int obj_instance_inline_count(const ObjInstance* instance);
+extern inline int obj_instance_find_inline(const ObjInstance* instance, const ObjString* name);
+extern inline bool obj_instance_get(const ObjInstance* instance, const ObjString* name, Value* value);
 extern inline ObjFunction* value_as_function(Value value);
 extern inline ObjClosure* value_as_closure(Value value);
 extern inline NativeFn value_as_native(Value value);
 extern inline ObjClass* value_as_class(Value value);
 extern inline ObjInstance* value_as_instance(Value value);
 extern inline ObjBoundMethod* value_as_method(Value value);
+extern inline bool value_is_list(Value value);
+extern inline ObjList* value_as_list(Value value);
+extern inline bool value_is_map(Value value);
+extern inline bool value_is_float64_array(Value value);
+extern inline bool value_is_bytes(Value value);
+extern inline ObjBytes* value_as_bytes(Value value);
+extern inline uint8_t* obj_bytes_data(const ObjBytes* bytes);
+extern inline ObjFloat64Array* value_as_float64_array(Value value);
+extern inline ObjMap* value_as_map(Value value);
+extern inline bool value_is_file(Value value);
+extern inline ObjFile* value_as_file(Value value);
+
+/* Copies the contents of ROPE into BUFFER, from right to left. Iterative, since
+ropes built inside loops can get really deep. */
+static void rope_copy(const ObjRope* rope, char* buffer)
+{
+	stack_t pending;
+	stack_init(&pending, 0, sizeof(const Obj*), STDLIB_ALLOCATOR);
+
+	size_t end = rope->length;
+	const Obj* node = (const Obj*)rope;
+	for (;;) {
+		if (node->type == OBJ_ROPE && ((const ObjRope*)node)->flat != 0)
+			node = heap_deref(node, ((const ObjRope*)node)->flat);
+
+		if (node->type == OBJ_STRING) {
+			const ObjString* string = (const ObjString*)node;
+			end -= string->length;
+			memcpy(buffer + end, string->chars, string->length);
+		} else if (((const ObjRope*)node)->right == 0) {
+			const ObjRope* slice = (const ObjRope*)node;
+			const ObjString* string = (const ObjString*)heap_deref(node, slice->left);
+			end -= slice->length;
+			memcpy(buffer + end, string->chars + slice->start, slice->length);
+		} else {
+			const ObjRope* concat = (const ObjRope*)node;
+			const Obj* left = heap_deref(node, concat->left);
+			stack_push(&pending, &left);
+			node = heap_deref(node, concat->right);
+			continue;
+		}
+
+		if (stack_empty(&pending)) break;
+		stack_pop(&pending, &node);
+	}
+
+	stack_destroy(&pending);
+}
+
+static void write_rope(const ObjRope* rope, Output* out)
+{
+	if (rope->flat != 0) {
+		const ObjString* flat = (const ObjString*)heap_deref(&rope->obj, rope->flat);
+		output_char(out, '"');
+		output_write(out, flat->chars, flat->length);
+		output_char(out, '"');
+		return;
+	} else if (rope->right == 0) {
+		const ObjString* string = (const ObjString*)heap_deref(&rope->obj, rope->left);
+		output_char(out, '"');
+		output_write(out, string->chars + rope->start, rope->length);
+		output_char(out, '"');
+		return;
+	}
+
+	char* buffer = malloc(rope->length);
+	if (buffer == NULL) {
+		output_str(out, "<rope>");
+		return;
+	}
+	rope_copy(rope, buffer);
+	output_char(out, '"');
+	output_write(out, buffer, rope->length);
+	output_char(out, '"');
+	free(buffer);
+}
+
+static void write_function(const ObjFunction* function, Output* out)
+{
+	if (function->name == NULL) {
+		output_str(out, "<script>");
+	} else {
+		output_str(out, "<fn ");
+		output_write(out, function->name->chars, function->name->length);
+		output_char(out, '>');
+	}
+}
+
+// The lists and maps being written, innermost first, so that ones which contain themselves end.
+typedef struct Enclosing {
+	const Obj* container;
+	const struct Enclosing* outer;
+} Enclosing;
+
+static bool is_enclosing(const Obj* object, const Enclosing* enclosing)
+{
+	for (; enclosing != NULL; enclosing = enclosing->outer) {
+		if (enclosing->container == object)
+			return true;
+	}
+	return false;
+}
+
+static void write_obj(Value value, Output* out, const Enclosing* enclosing);
 
-static void print_function(ObjFunction* function)
+// Writes VALUE, which is inside the containers in ENCLOSING.
+static void write_nested(Value value, Output* out, const Enclosing* enclosing)
 {
-	if (function->name == NULL)
-		printf("<script>");
+	if (value_is_obj(value))
+		write_obj(value, out, enclosing);
 	else
-		printf("<fn %s>", function->name->chars);
+		value_write(value, out);
 }
 
-void obj_print(Value value)
+typedef struct {
+	Output* out;
+	const Enclosing* enclosing;
+	bool first;
+} EntryWriter;
+
+static void write_entry(Value* key, Value* value, void* writer_ptr)
+{
+	EntryWriter* writer = (EntryWriter*)writer_ptr;
+	if (!writer->first) output_str(writer->out, ", ");
+	writer->first = false;
+	write_nested(*key, writer->out, writer->enclosing);
+	output_str(writer->out, ": ");
+	write_nested(*value, writer->out, writer->enclosing);
+}
+
+void obj_write(Value value, Output* out)
+{
+	write_obj(value, out, NULL);
+}
+
+static void write_obj(Value value, Output* out, const Enclosing* enclosing)
 {
 	switch (obj_type(value)) {
 		case OBJ_STRING:
-			printf("\"%s\"", value_as_c_str(value));
+			output_char(out, '"');
+			output_write(out, value_as_c_str(value), value_as_string(value)->length);
+			output_char(out, '"');
+			break;
+		case OBJ_ROPE:
+			write_rope(value_as_rope(value), out);
 			break;
 		case OBJ_FUNCTION:
-			print_function(value_as_function(value));
+			write_function(value_as_function(value), out);
 			break;
 		case OBJ_CLOSURE:
-			print_function(value_as_closure(value)->function);
+			write_function(value_as_closure(value)->function, out);
 			break;
 		case OBJ_UPVALUE:
-			printf("upvalue");
+			output_str(out, "upvalue");
 			break;
 		case OBJ_NATIVE:
-			printf("<native fn>");
+			output_str(out, "<native fn>");
 			break;
 		case OBJ_CLASS:
-			printf("%s", value_as_class(value)->name->chars);
+			output_str(out, value_as_class(value)->name->chars);
 			break;
 		case OBJ_INSTANCE:
-			printf("%s instance", value_as_instance(value)->class->name->chars);
+			output_str(out, obj_instance_class(value_as_instance(value))->name->chars);
+			output_str(out, " instance");
 			break;
 		case OBJ_BOUND_METHOD:
-			print_function(value_as_method(value)->method->function);
+			write_function(value_as_method(value)->method->function, out);
+			break;
+		case OBJ_LIST: {
+			const ObjList* list = value_as_list(value);
+			const Enclosing inner = { .container = &list->obj, .outer = enclosing };
+			if (is_enclosing(inner.container, enclosing)) {
+				output_str(out, "[...]");
+				break;
+			}
+			output_char(out, '[');
+			for (int i = 0; i < list->count; ++i) {
+				if (i > 0) output_str(out, ", ");
+				write_nested(list->items[i], out, &inner);
+			}
+			output_char(out, ']');
+			break;
+		}
+		case OBJ_BYTES: {
+			const ObjBytes* bytes = value_as_bytes(value);
+			const uint8_t* data = obj_bytes_data(bytes);
+			output_str(out, "Bytes[");
+			for (int i = 0; i < bytes->length; ++i) {
+				if (i > 0) output_str(out, ", ");
+				value_write(int_value(data[i]), out);
+			}
+			output_char(out, ']');
+			break;
+		}
+		case OBJ_FLOAT64_ARRAY: {
+			const ObjFloat64Array* array = value_as_float64_array(value);
+			output_str(out, "Float64Array[");
+			for (int i = 0; i < array->count; ++i) {
+				if (i > 0) output_str(out, ", ");
+				value_write(number_value(array->items[i]), out);
+			}
+			output_char(out, ']');
 			break;
+		}
+		case OBJ_FILE:
+			output_str(out, value_as_file(value)->stream != NULL ? "<file>" : "<closed file>");
+			break;
+		case OBJ_MAP: {
+			const ObjMap* map = value_as_map(value);
+			const Enclosing inner = { .container = &map->obj, .outer = enclosing };
+			if (is_enclosing(inner.container, enclosing)) {
+				output_str(out, "{...}");
+				break;
+			}
+			EntryWriter writer = { .out = out, .enclosing = &inner, .first = true };
+			output_char(out, '{');
+			value_map_for_each(&value_as_map(value)->map, write_entry, &writer);
+			output_char(out, '}');
+			break;
+		}
 		default:
 			fprintf(stderr, "Invalid object type %d during print.\n", obj_type(value));
 			assert(false);
@@ -73,91 +272,80 @@ void obj_print(Value value)
 
 void free_obj(Environment *env, Obj* object)
 {
-	#define FREE_OBJ(object, type) reallocate(env, (object), 0, #type)
-
 	switch (object->type) {
-		case OBJ_STRING: {
-			ObjString* string = (ObjString*)object;
-			reallocate(env, string->chars, 0, "string");
-			FREE_OBJ(object, ObjString);
-			break;
-		}
 		case OBJ_FUNCTION:
 			chunk_destroy(&((ObjFunction*)object)->bytecode);
-			FREE_OBJ(object, ObjFunction);
 			break;
-		case OBJ_CLOSURE: {
-			ObjClosure* closure = (ObjClosure*)object;
-			reallocate(env, closure->upvalues, 0, "upvalues[]");
-			FREE_OBJ(object, ObjClosure);
-			break;
-		}
-		case OBJ_UPVALUE:
-			FREE_OBJ(object, ObjUpvalue);
-			break;
-		case OBJ_NATIVE:
-			FREE_OBJ(object, ObjNative);
+		case OBJ_CLOSURE:
+			reallocate(env, ((ObjClosure*)object)->upvalues, 0, "upvalues[]");
 			break;
 		case OBJ_CLASS: {
 			ObjClass* class = (ObjClass*)object;
 			table_destroy(&class->methods);
-			FREE_OBJ(object, ObjClass);
+			reallocate(env, class->vtable, 0, "vtable");
 			break;
 		}
 		case OBJ_INSTANCE: {
-			ObjInstance* instance = (ObjInstance*)object;
-			table_destroy(&instance->fields);
-			FREE_OBJ(object, ObjInstance);
+			Table* fields = ((ObjInstance*)object)->fields;
+			if (fields != NULL) {
+				table_destroy(fields);
+				reallocate(env, fields, 0, "Table");
+			}
 			break;
 		}
+		case OBJ_LIST:
+			reallocate(env, ((ObjList*)object)->items, 0, "items[]");
+			break;
+		case OBJ_BYTES:
+			reallocate(env, ((ObjBytes*)object)->data, 0, "data[]");
+			break;
+		case OBJ_FLOAT64_ARRAY:
+			reallocate(env, ((ObjFloat64Array*)object)->items, 0, "items[]");
+			break;
+		case OBJ_MAP:
+			value_map_destroy(&((ObjMap*)object)->map);
+			break;
+		case OBJ_FILE:
+			if (((ObjFile*)object)->stream != NULL)
+				obj_file_close(env, (ObjFile*)object);
+			break;
+		case OBJ_STRING: case OBJ_ROPE: case OBJ_UPVALUE: case OBJ_NATIVE:
 		case OBJ_BOUND_METHOD:
-			FREE_OBJ(object, ObjBoundMethod);
 			break;
 		default:
 			fprintf(stderr, "Invalid object type %d to be freed.\n", object->type);
 			assert(false);
 	}
+}
 
-	#undef FREE_OBJ
+static void free_each_obj(Obj* object, void* env)
+{
+	free_obj((Environment*)env, object);
 }
 
 void free_objects(Environment *env)
 {
-	while (env->objects != NULL) {
-		Obj* next = env->objects->next;
-		free_obj(env, env->objects);
-		env->objects = next;
-	}
+	heap_destroy(&env->heap, free_each_obj, env);
 }
 
 static Obj* allocate_obj(Environment *env, size_t size, ObjType type, const char* why)
 {
-	Obj* obj = reallocate(env, NULL, size, why);
+	Obj* obj = allocate_cell(env, size, why);
 	obj->type = type;
-	obj->next = env->objects;
-	obj->marked = false;
-	env->objects = obj;
+	obj->flags = 0;
+	obj->hash = 0;
 	return obj;
 }
 
 #define ALLOCATE_OBJ(env, type, enum_type) \
 	(type*)allocate_obj((env), sizeof(type), (enum_type), #type);
 
-static ObjString* make_obj_string_copy(Environment *env, const char* str, size_t n, hash_t hash)
+static ObjString* allocate_string(Environment *env, size_t n)
 {
-	char* chars = reallocate(env, NULL, n + 1, "string");
-	memcpy(chars, str, n);
-	chars[n] = '\0';
-
-	ObjString* string = ALLOCATE_OBJ(env, ObjString, OBJ_STRING);
-	string->hash = hash;
+	const size_t size = sizeof(ObjString) + n + 1;
+	ObjString* string = (ObjString*)allocate_obj(env, size, OBJ_STRING, "ObjString");
 	string->length = n;
-	string->chars = chars;
-
-	string->obj.marked = true;
-	table_put(&env->strings, string, nil_value());
-	string->obj.marked = false;
-
+	string->chars[n] = '\0';
 	return string;
 }
 
@@ -165,22 +353,112 @@ ObjString* make_obj_string(Environment *env, const char* str, size_t n)
 {
 	const hash_t hash = table_hash(str, n);
 	ObjString* interned = table_find_string(&env->strings, str, n, hash);
-	return interned != NULL ? interned
-	                        : make_obj_string_copy(env, str, n, hash);
+	if (interned != NULL)
+		return interned;
+
+	ObjString* string = allocate_string(env, n);
+	memcpy(string->chars, str, n);
+	string->obj.hash = hash;
+	string->obj.flags = STRING_HASHED | STRING_INTERNED;
+
+	heap_mark((Obj*)string);
+	table_put(&env->strings, string, nil_value());
+	heap_unmark((Obj*)string);
+	return string;
 }
 
-ObjString* obj_string_concat(Environment *env, const ObjString* prefix, const ObjString* suffix)
+ObjString* make_obj_string_uninterned(Environment *env, const char* str, size_t n)
 {
-	// prepare temporary resultant string for hash
-	const size_t n = prefix->length + suffix->length;
-	char str[n]; // VLA
-	memcpy(str, prefix->chars, prefix->length);
-	memcpy(str + prefix->length, suffix->chars, suffix->length);
+	ObjString* string = allocate_string(env, n);
+	memcpy(string->chars, str, n);
+	return string;
+}
 
-	const hash_t hash = table_hash(str, n);
-	ObjString* interned = table_find_string(&env->strings, str, n, hash);
-	return interned != NULL ? interned
-	                        : make_obj_string_copy(env, str, n, hash);
+ObjString* make_obj_string_buffer(Environment *env, size_t length)
+{
+	return allocate_string(env, length);
+}
+
+bool obj_string_equal(const ObjString* a, const ObjString* b)
+{
+	if (a == b)
+		return true;
+	else if (a->obj.flags & b->obj.flags & STRING_INTERNED)
+		return false;
+	else if (a->length != b->length)
+		return false;
+	else if (obj_string_hash(a) != obj_string_hash(b))
+		return false;
+	else
+		return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+static size_t string_length(const Obj* string)
+{
+	return string->type == OBJ_STRING ? ((const ObjString*)string)->length
+	                                  : ((const ObjRope*)string)->length;
+}
+
+// Skips ropes which have already been flattened.
+static Obj* string_contents(Obj* string)
+{
+	if (string->type == OBJ_ROPE && ((ObjRope*)string)->flat != 0)
+		return heap_deref(string, ((ObjRope*)string)->flat);
+	return string;
+}
+
+Obj* obj_string_concat(Environment *env, Obj* prefix, Obj* suffix)
+{
+	prefix = string_contents(prefix);
+	suffix = string_contents(suffix);
+	const size_t n = string_length(prefix) + string_length(suffix);
+
+	// ropes are never shorter than this, so both operands must be flat here
+	if (n < STRING_ROPE_MIN) {
+		const ObjString* a = (const ObjString*)prefix;
+		const ObjString* b = (const ObjString*)suffix;
+		ObjString* string = allocate_string(env, n);
+		memcpy(string->chars, a->chars, a->length);
+		memcpy(string->chars + a->length, b->chars, b->length);
+		return (Obj*)string;
+	}
+
+	ObjRope* rope = ALLOCATE_OBJ(env, ObjRope, OBJ_ROPE);
+	rope->length = n;
+	rope->left = heap_ref(prefix);
+	rope->right = heap_ref(suffix);
+	rope->flat = 0;
+	rope->start = 0;
+	return (Obj*)rope;
+}
+
+Obj* obj_string_slice(Environment *env, ObjString* string, size_t start, size_t length)
+{
+	// like concatenations, so that ropes are never shorter than this either
+	if (length < STRING_ROPE_MIN)
+		return (Obj*)make_obj_string_uninterned(env, string->chars + start, length);
+
+	ObjRope* slice = ALLOCATE_OBJ(env, ObjRope, OBJ_ROPE);
+	slice->length = length;
+	slice->left = heap_ref(&string->obj);
+	slice->right = 0;
+	slice->flat = 0;
+	slice->start = start;
+	return (Obj*)slice;
+}
+
+ObjString* obj_rope_flatten(Environment *env, ObjRope* rope)
+{
+	if (rope->flat != 0)
+		return (ObjString*)heap_deref(&rope->obj, rope->flat);
+
+	ObjString* string = allocate_string(env, rope->length);
+	rope_copy(rope, string->chars);
+
+	rope->flat = heap_ref(&string->obj);
+	rope->left = 0;
+	rope->right = 0;
+	return string;
 }
 
 ObjFunction* make_obj_function(Environment *env)
@@ -210,7 +488,6 @@ ObjClosure* make_obj_closure(Environment *env, ObjFunction* function)
 	ObjClosure* closure = ALLOCATE_OBJ(env, ObjClosure, OBJ_CLOSURE);
 	closure->function = function;
 	closure->upvalues = upvalues;
-	closure->upvalue_count = function->upvalues;
 
 	return closure;
 }
@@ -229,17 +506,138 @@ ObjClass* make_obj_class(Environment *env, ObjString* name)
 	ObjClass* class = ALLOCATE_OBJ(env, ObjClass, OBJ_CLASS);
 	class->name = name;
 	table_init(&class->methods, env); // initialized with 0 size, so it is GC safe
+	class->vtable = NULL;
+	class->vtable_base = 0;
+	class->vtable_size = 0;
 	return class;
 }
 
+// Vtables may have a few holes, but not much more than that.
+static bool too_sparse(int vtable_size, size_t methods)
+{
+	return (size_t)vtable_size > 4 * methods + 8;
+}
+
+static void drop_vtable(Environment *env, ObjClass* class)
+{
+	reallocate(env, class->vtable, 0, "vtable");
+	class->vtable = NULL;
+	class->vtable_base = 0;
+	class->vtable_size = 0;
+	class->obj.flags |= CLASS_SPARSE;
+}
+
+// Makes CLASS's vtable span selectors from BASE to BASE + SIZE - 1, keeping its contents.
+static void resize_vtable(Environment *env, ObjClass* class, int base, int size)
+{
+	ObjClosure** vtable = reallocate(env, NULL, size * sizeof(ObjClosure*), "vtable");
+	for (int i = 0; i < size; ++i)
+		vtable[i] = NULL;
+	for (int i = 0; i < class->vtable_size; ++i)
+		vtable[class->vtable_base - base + i] = class->vtable[i];
+
+	reallocate(env, class->vtable, 0, "vtable");
+	class->vtable = vtable;
+	class->vtable_base = base;
+	class->vtable_size = size;
+}
+
+void obj_class_define(Environment *env, ObjClass* class,
+                      ObjString* name, int selector, ObjClosure* method)
+{
+	table_put(&class->methods, name, obj_value((Obj*)method));
+	if (class->obj.flags & CLASS_SPARSE)
+		return;
+
+	if (obj_class_dispatch(class, selector) == NULL) {
+		const int end = class->vtable_base + class->vtable_size;
+		const int base = class->vtable_size == 0 || selector < class->vtable_base
+		               ? selector : class->vtable_base;
+		const int size = (selector >= end ? selector + 1 : end) - base;
+		if (too_sparse(size, class->methods.count)) {
+			drop_vtable(env, class);
+			return;
+		}
+		if (size != class->vtable_size)
+			resize_vtable(env, class, base, size);
+	}
+	class->vtable[selector - class->vtable_base] = method;
+}
+
+static void inherit_each_method(const ObjString* name, Value* method, void* class_ptr)
+{
+	ObjClass* class = (ObjClass*)class_ptr;
+	table_put(&class->methods, name, *method);
+}
+
+void obj_class_inherit(Environment *env, ObjClass* class, const ObjClass* superclass)
+{
+	table_for_each(&superclass->methods, inherit_each_method, class);
+
+	if (superclass->obj.flags & CLASS_SPARSE) {
+		drop_vtable(env, class);
+	} else if (superclass->vtable_size > 0) {
+		resize_vtable(env, class, superclass->vtable_base, superclass->vtable_size);
+		for (int i = 0; i < superclass->vtable_size; ++i)
+			class->vtable[i] = superclass->vtable[i];
+	}
+}
+
 ObjInstance* make_obj_instance(Environment *env, ObjClass* class)
 {
 	ObjInstance* instance = ALLOCATE_OBJ(env, ObjInstance, OBJ_INSTANCE);
-	instance->class = class;
-	table_init(&instance->fields, env); // initialized with 0 size, so it is GC safe
+	instance->class = heap_ref(&class->obj);
+	instance->fields = NULL;
 	return instance;
 }
 
+static void set_inline_count(ObjInstance* instance, int count)
+{
+	instance->obj.flags = (instance->obj.flags & ~INSTANCE_INLINE_COUNT) | count;
+}
+
+bool obj_instance_set(Environment *env, ObjInstance* instance, ObjString* name, Value value)
+{
+	const int i = obj_instance_find_inline(instance, name);
+	if (i >= 0) {
+		instance->values[i] = value;
+		return true;
+	}
+
+	// deletions may leave inline room while the table is in use
+	const int count = obj_instance_inline_count(instance);
+	Value existing;
+	if (count < INSTANCE_INLINE_FIELDS
+	    && (instance->fields == NULL || !table_get(instance->fields, name, &existing))) {
+		instance->names[count] = heap_ref(&name->obj);
+		instance->values[count] = value;
+		set_inline_count(instance, count + 1);
+		if (!(name->obj.flags & STRING_INTERNED))
+			instance->obj.flags |= INSTANCE_UNINTERNED;
+		return false;
+	}
+
+	if (instance->fields == NULL) {
+		Table* fields = reallocate(env, NULL, sizeof(Table), "Table");
+		table_init(fields, env); // initialized with 0 size, so it is GC safe
+		instance->fields = fields;
+	}
+	return table_put(instance->fields, name, value);
+}
+
+bool obj_instance_delete(ObjInstance* instance, const ObjString* name)
+{
+	const int i = obj_instance_find_inline(instance, name);
+	if (i < 0)
+		return instance->fields != NULL && table_delete(instance->fields, name);
+
+	const int last = obj_instance_inline_count(instance) - 1;
+	instance->names[i] = instance->names[last];
+	instance->values[i] = instance->values[last];
+	set_inline_count(instance, last);
+	return true;
+}
+
 ObjBoundMethod* make_obj_method(Environment *env, Value receiver, ObjClosure* method)
 {
 	ObjBoundMethod* bound = ALLOCATE_OBJ(env, ObjBoundMethod, OBJ_BOUND_METHOD);
@@ -248,4 +646,232 @@ ObjBoundMethod* make_obj_method(Environment *env, Value receiver, ObjClosure* me
 	return bound;
 }
 
+ObjList* make_obj_list(Environment *env)
+{
+	ObjList* list = ALLOCATE_OBJ(env, ObjList, OBJ_LIST);
+	list->items = NULL;
+	list->count = 0;
+	list->capacity = 0;
+	return list;
+}
+
+void obj_list_reserve(Environment *env, ObjList* list, int capacity)
+{
+	if (capacity <= list->capacity)
+		return;
+
+	// the GC may run here, while the list still has its old items
+	Value* items = reallocate(env, NULL, capacity * sizeof(Value), "items[]");
+	for (int i = 0; i < list->count; ++i)
+		items[i] = list->items[i];
+
+	reallocate(env, list->items, 0, "items[]");
+	list->items = items;
+	list->capacity = capacity;
+}
+
+void obj_list_insert(Environment *env, ObjList* list, int index, Value value)
+{
+	assert(index >= 0 && index <= list->count);
+	if (list->count == list->capacity)
+		obj_list_reserve(env, list, list->capacity < 8 ? 8 : list->capacity * 2);
+
+	memmove(&list->items[index + 1], &list->items[index], (list->count - index) * sizeof(Value));
+	list->items[index] = value;
+	list->count++;
+}
+
+Value obj_list_remove(ObjList* list, int index)
+{
+	assert(index >= 0 && index < list->count);
+	const Value value = list->items[index];
+	list->count--;
+	memmove(&list->items[index], &list->items[index + 1], (list->count - index) * sizeof(Value));
+	return value;
+}
+
+ObjBytes* make_obj_bytes(Environment *env, int length)
+{
+	// as with arrays, the data can't be reached by the GC until it's set up
+	uint8_t* data = reallocate(env, NULL, length, "data[]");
+	if (length > 0) memset(data, 0, length);
+
+	ObjBytes* bytes = ALLOCATE_OBJ(env, ObjBytes, OBJ_BYTES);
+	bytes->owner = 0;
+	bytes->data = data;
+	bytes->offset = 0;
+	bytes->length = length;
+	bytes->capacity = length;
+	return bytes;
+}
+
+ObjBytes* make_obj_bytes_slice(Environment *env, ObjBytes* bytes, int start, int length)
+{
+	assert(start >= 0 && length >= 0 && start + length <= bytes->length);
+	ObjBytes* slice = ALLOCATE_OBJ(env, ObjBytes, OBJ_BYTES);
+	if (bytes->owner != 0) {
+		slice->owner = bytes->owner;
+		slice->offset = bytes->offset + start;
+	} else {
+		slice->owner = heap_ref(&bytes->obj);
+		slice->offset = start;
+	}
+	slice->data = NULL;
+	slice->length = length;
+	slice->capacity = 0;
+	return slice;
+}
+
+void obj_bytes_reserve(Environment *env, ObjBytes* bytes, int capacity)
+{
+	if (bytes->owner == 0 && capacity <= bytes->capacity)
+		return;
+	else if (capacity < bytes->length)
+		capacity = bytes->length;
+
+	// the GC may run here, while the buffer (or its owner) still has its old data
+	uint8_t* data = reallocate(env, NULL, capacity, "data[]");
+	if (bytes->length > 0)
+		memcpy(data, obj_bytes_data(bytes), bytes->length);
+
+	reallocate(env, bytes->data, 0, "data[]");
+	bytes->owner = 0;
+	bytes->data = data;
+	bytes->offset = 0;
+	bytes->capacity = capacity;
+}
+
+void obj_bytes_append(Environment *env, ObjBytes* bytes, const uint8_t* data, int n)
+{
+	const int length = bytes->length + n;
+	if (bytes->owner != 0 || length > bytes->capacity) {
+		int capacity = bytes->capacity < 8 ? 8 : bytes->capacity * 2;
+		if (capacity < length) capacity = length;
+
+		// DATA could be in the storage about to be replaced, so it's found again after
+		const uint8_t* old = obj_bytes_data(bytes);
+		const bool inside = data >= old && data < old + bytes->length;
+		const ptrdiff_t position = inside ? data - old : 0;
+		obj_bytes_reserve(env, bytes, capacity);
+		if (inside) data = bytes->data + position;
+	}
+
+	memmove(bytes->data + bytes->length, data, n);
+	bytes->length = length;
+}
+
+ObjFloat64Array* make_obj_float64_array(Environment *env, int count)
+{
+	// items come first, since the GC can't reach them until the array is set up
+	double* items = reallocate(env, NULL, count * sizeof(double), "items[]");
+	if (count > 0) memset(items, 0, count * sizeof(double));
+
+	ObjFloat64Array* array = ALLOCATE_OBJ(env, ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+	array->items = items;
+	array->count = count;
+	return array;
+}
+
+ObjMap* make_obj_map(Environment *env)
+{
+	ObjMap* map = ALLOCATE_OBJ(env, ObjMap, OBJ_MAP);
+	value_map_init(&map->map, env);
+	return map;
+}
+
+static void write_stream(void* stream, const char* data, size_t length)
+{
+	fwrite(data, 1, length, (FILE*)stream);
+}
+
+ObjFile* make_obj_file(Environment *env, FILE* stream, bool writing)
+{
+	// the file's own buffer is the only one, and it stays put as the GC moves the file
+	setvbuf(stream, NULL, _IONBF, 0);
+	char* buffer = reallocate(env, NULL, FILE_BUFFER_SIZE, "buffer[]");
+
+	ObjFile* file = ALLOCATE_OBJ(env, ObjFile, OBJ_FILE);
+	file->stream = stream;
+	file->writing = writing;
+	file->buffer = buffer;
+	file->capacity = FILE_BUFFER_SIZE;
+	file->start = 0;
+	file->end = 0;
+	output_init(&file->output, buffer, FILE_BUFFER_SIZE);
+	output_set_sink(&file->output, write_stream, stream);
+	return file;
+}
+
+/* Moves the bytes read ahead in FILE to the start of its buffer, and reads more
+after them, growing the buffer when it's full. Returns false at the end. */
+static bool file_refill(Environment *env, ObjFile* file)
+{
+	if (file->start > 0) {
+		memmove(file->buffer, file->buffer + file->start, file->end - file->start);
+		file->end -= file->start;
+		file->start = 0;
+	}
+	if (file->end == file->capacity) {
+		file->buffer = reallocate(env, file->buffer, 2 * (size_t)file->capacity, "buffer[]");
+		file->capacity *= 2;
+	}
+	const size_t n = fread(file->buffer + file->end, 1, file->capacity - file->end, file->stream);
+	file->end += (int)n;
+	return n > 0;
+}
+
+ObjString* obj_file_read_line(Environment *env, ObjFile* file)
+{
+	int checked = 0; // bytes read ahead which are known not to be newlines
+	for (;;) {
+		const char* start = file->buffer + file->start;
+		const char* newline = memchr(start + checked, '\n', file->end - file->start - checked);
+		if (newline != NULL) {
+			file->start += (int)(newline - start) + 1;
+			return make_obj_string_uninterned(env, start, newline - start);
+		}
+		checked = file->end - file->start;
+		if (!file_refill(env, file)) break;
+	}
+
+	// the last line may not end with a newline
+	if (file->start == file->end) return NULL;
+	const int length = file->end - file->start;
+	file->start = file->end;
+	return make_obj_string_uninterned(env, file->buffer + file->end - length, length);
+}
+
+size_t obj_file_read(Environment *env, ObjFile* file, char* destination, size_t n)
+{
+	size_t copied = 0;
+	while (copied < n) {
+		if (file->start == file->end) {
+			if (n - copied >= (size_t)file->capacity)
+				return copied + fread(destination + copied, 1, n - copied, file->stream);
+			else if (!file_refill(env, file))
+				break;
+		}
+		const size_t available = file->end - file->start;
+		const size_t taken = n - copied < available ? n - copied : available;
+		memcpy(destination + copied, file->buffer + file->start, taken);
+		file->start += (int)taken;
+		copied += taken;
+	}
+	return copied;
+}
+
+bool obj_file_close(Environment *env, ObjFile* file)
+{
+	if (file->writing) output_flush(&file->output);
+	bool ok = !ferror(file->stream);
+	ok &= fclose(file->stream) == 0;
+	reallocate(env, file->buffer, 0, "buffer[]");
+	file->stream = NULL;
+	file->buffer = NULL;
+	file->capacity = 0;
+	file->start = 0;
+	file->end = 0;
+	return ok;
+}
+
 #undef ALLOCATE_OBJ
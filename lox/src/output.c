@@ -0,0 +1,69 @@
+#define _POSIX_C_SOURCE 200809L // fileno, isatty
+
+#include "output.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy, memchr, strlen
+#ifdef __unix__
+#	include <unistd.h> // isatty
+#endif
+
+
+extern inline void output_char(Output* out, char c);
+
+static void stdout_sink(void* context, const char* data, size_t length)
+{
+	fwrite(data, 1, length, stdout);
+	fflush(stdout);
+}
+
+void output_init(Output* out, char* buffer, size_t capacity)
+{
+	out->buffer = buffer;
+	out->length = 0;
+	out->capacity = capacity;
+	out->sink = stdout_sink;
+	out->context = NULL;
+#ifdef __unix__
+	out->flush_lines = isatty(fileno(stdout));
+#else
+	out->flush_lines = false;
+#endif
+}
+
+void output_set_sink(Output* out, OutputSink sink, void* context)
+{
+	output_flush(out);
+	out->sink = sink;
+	out->context = context;
+	out->flush_lines = false;
+}
+
+void output_flush(Output* out)
+{
+	if (out->length == 0) return;
+	out->sink(out->context, out->buffer, out->length);
+	out->length = 0;
+}
+
+void output_write(Output* out, const char* data, size_t n)
+{
+	if (n > out->capacity - out->length) {
+		output_flush(out);
+		// anything that wouldn't fit even in an empty buffer skips it
+		if (n > out->capacity) {
+			out->sink(out->context, data, n);
+			return;
+		}
+	}
+
+	memcpy(out->buffer + out->length, data, n);
+	out->length += n;
+	if (out->flush_lines && memchr(data, '\n', n) != NULL)
+		output_flush(out);
+}
+
+void output_str(Output* out, const char* str)
+{
+	output_write(out, str, strlen(str));
+}
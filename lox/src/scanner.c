@@ -13,6 +13,7 @@ void scanner_start(Scanner* scanner, const char* source)
 	scanner->start = source;
 	scanner->current = source;
 	scanner->line = 1;
+	scanner->interpolations = 0;
 }
 
 // Peeks at the current character without consuming it.
@@ -97,10 +98,19 @@ static Token error_token(const Scanner* scanner, const char* message)
 	};
 }
 
+/* Scans the rest of a string, which started at either a '"' or the '}' closing an
+interpolation. Stops at the closing quote, or right after the next "${". */
 static Token scan_string(Scanner* scanner)
 {
 	while (peek(scanner) != '"' && !at_end(scanner)) {
-		if (peek(scanner) == '\n') {
+		if (peek(scanner) == '$' && peek_next(scanner) == '{') {
+			if (scanner->interpolations == INTERPOLATION_MAX)
+				return error_token(scanner, "Interpolation nested too deeply.");
+			scanner->braces[scanner->interpolations++] = 0;
+			advance(scanner);
+			advance(scanner);
+			return make_token(scanner, TOKEN_INTERPOLATION);
+		} else if (peek(scanner) == '\n') {
 			scanner->line++;
 		}
 		advance(scanner);
@@ -210,11 +220,25 @@ static Token scan_token_(Scanner* scanner)
 	switch (c) {
 		case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
 		case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
-		case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
-		case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+		case '{':
+			if (scanner->interpolations > 0)
+				scanner->braces[scanner->interpolations - 1]++;
+			return make_token(scanner, TOKEN_LEFT_BRACE);
+		case '}':
+			if (scanner->interpolations > 0) {
+				// a '}' without a matching '{' resumes the string being interpolated
+				if (scanner->braces[scanner->interpolations - 1]-- == 0) {
+					scanner->interpolations--;
+					return scan_string(scanner);
+				}
+			}
+			return make_token(scanner, TOKEN_RIGHT_BRACE);
+		case '[': return make_token(scanner, TOKEN_LEFT_BRACKET);
+		case ']': return make_token(scanner, TOKEN_RIGHT_BRACKET);
 		case ';': return make_token(scanner, TOKEN_SEMICOLON);
 		case ',': return make_token(scanner, TOKEN_COMMA);
 		case '.': return make_token(scanner, TOKEN_DOT);
+		case ':': return make_token(scanner, TOKEN_COLON);
 		case '-': return make_token(scanner, TOKEN_MINUS);
 		case '+': return make_token(scanner, TOKEN_PLUS);
 		case '/': return make_token(scanner, TOKEN_SLASH);
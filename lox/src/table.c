@@ -1,110 +1,400 @@
 #include "table.h"
 
-#include <string.h> // memcmp
-
-#include <ugly/map.h>
-#include <ugly/core.h> // err_t
+#include <string.h> // memcmp, memcpy
+#include <stdint.h>
 
 #include "object.h" // ObjString
 #include "common.h" // NULL
 #include "memory.h" // reallocate
 
 
-struct key {
-	hash_t hash;
-	size_t length;
-	const char* str;
-};
-
-struct val {
-	ObjString* string;
+struct TableEntry {
+	ObjString* key;
 	Value value;
 };
 
-struct for_each_closure {
-	void (*func)(const ObjString*, Value*, void*);
-	void* forward;
-};
+#define GROUP_SIZE 8 // control bytes probed at once, as a 64-bit word
+#define MIN_CAPACITY GROUP_SIZE
+
+// Control bytes: 0b0hhhhhhh for full slots, with 7 bits of their key's hash.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+#define LSBS 0x0101010101010101ull
+#define MSBS 0x8080808080808080ull
 
 
-static hash_t hash(const void* ptr, size_t size)
+static inline int first_byte(uint64_t mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(mask) / 8;
+#else
+	int n = 0;
+	for (; (mask & 0xFF) == 0; mask >>= 8) ++n;
+	return n;
+#endif
+}
+
+// Loads the GROUP_SIZE control bytes starting at P, with the first one in the lowest bits.
+static inline uint64_t group_load(const uint8_t* p)
+{
+	uint64_t group;
+	memcpy(&group, p, sizeof(group));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	group = __builtin_bswap64(group);
+#endif
+	return group;
+}
+
+/* Sets the high bit in each byte of GROUP which is equal to H2. This may give
+false positives (only after a true positive), but those just fail comparison. */
+static inline uint64_t group_match(uint64_t group, uint8_t h2)
+{
+	const uint64_t x = group ^ (LSBS * h2);
+	return (x - LSBS) & ~x & MSBS;
+}
+
+static inline uint64_t group_match_empty(uint64_t group)
+{
+	return group & ~(group << 6) & MSBS;
+}
+
+static inline uint64_t group_match_empty_or_deleted(uint64_t group)
+{
+	return group & MSBS;
+}
+
+static inline size_t probe_start(const Table* table, hash_t hash)
 {
-	return ((const struct key*)ptr)->hash;
+	return (hash >> 7) & (table->capacity - 1);
 }
 
-static int comp(const void* a, const void* b)
+static inline uint8_t probe_tag(hash_t hash)
 {
-	const struct key* s1 = (const struct key*)a;
-	const struct key* s2 = (const struct key*)b;
-	if (s1->length != s2->length)
-		return s1->length - s2->length;
-	else if (s1->hash != s2->hash)
-		return s1->hash - s2->hash;
-	else
-		return memcmp(s1->str, s2->str, s1->length);
+	return hash & 0x7F;
 }
 
-static void* table_malloc(struct allocator *ctx, void* ptr, size_t size)
+/* Control bytes are followed by a copy of the first group, so that groups may
+be loaded from any slot without wrapping around. */
+static inline void set_control(Table* table, size_t index, uint8_t control)
 {
-	return reallocate((Environment*)ctx->environment, ptr, size, "Table");
+	table->control[index] = control;
+	if (index < GROUP_SIZE)
+		table->control[table->capacity + index] = control;
+}
+
+static inline bool same_key(const ObjString* a, const ObjString* b)
+{
+	return a == b || obj_string_equal(a, b);
+}
+
+static struct TableEntry* find_entry(const Table* table, const ObjString* key, hash_t hash)
+{
+	if (table->capacity == 0)
+		return NULL;
+
+	const size_t mask = table->capacity - 1;
+	const uint8_t tag = probe_tag(hash);
+	for (size_t pos = probe_start(table, hash);; pos = (pos + GROUP_SIZE) & mask) {
+		const uint64_t group = group_load(&table->control[pos]);
+		for (uint64_t match = group_match(group, tag); match != 0; match &= match - 1) {
+			struct TableEntry* entry = &table->entries[(pos + first_byte(match)) & mask];
+			if (same_key(entry->key, key))
+				return entry;
+		}
+		if (group_match_empty(group) != 0)
+			return NULL;
+	}
+}
+
+// Finds the first empty or deleted slot where a key with the given HASH can go.
+static size_t find_slot(const Table* table, hash_t hash)
+{
+	const size_t mask = table->capacity - 1;
+	for (size_t pos = probe_start(table, hash);; pos = (pos + GROUP_SIZE) & mask) {
+		const uint64_t available = group_match_empty_or_deleted(group_load(&table->control[pos]));
+		if (available != 0)
+			return (pos + first_byte(available)) & mask;
+	}
+}
+
+// How many slots may be taken before growing, which always leaves one empty.
+static inline size_t max_load(size_t capacity)
+{
+	const size_t load = capacity * TABLE_MAX_LOAD / 100;
+	return load < capacity || capacity == 0 ? load : capacity - 1;
+}
+
+static inline size_t min_load(size_t capacity)
+{
+	return capacity * TABLE_MIN_LOAD / 100;
+}
+
+static size_t allocation_size(size_t capacity)
+{
+	return capacity * sizeof(struct TableEntry) + capacity + GROUP_SIZE;
+}
+
+// Rehashes TABLE into CAPACITY slots (possibly zero), also getting rid of tombstones.
+static void resize(Table* table, size_t capacity)
+{
+	if (capacity == 0) {
+		table_destroy(table);
+		return;
+	}
+
+	// may trigger the GC, which only reads (or deletes from) the old arrays
+	struct TableEntry* entries = reallocate(table->env, NULL, allocation_size(capacity), "Table");
+
+	Table old = *table;
+	table->entries = entries;
+	table->control = (uint8_t*)(entries + capacity);
+	table->capacity = capacity;
+	table->count = old.count;
+	table->used = old.count;
+	memset(table->control, CONTROL_EMPTY, capacity + GROUP_SIZE);
+
+	for (size_t i = 0; i < old.capacity; ++i) {
+		if (old.control[i] & CONTROL_EMPTY) continue;
+		const hash_t hash = old.entries[i].key->obj.hash;
+		const size_t slot = find_slot(table, hash);
+		set_control(table, slot, probe_tag(hash));
+		table->entries[slot] = old.entries[i];
+	}
+
+	reallocate(table->env, old.entries, 0, "Table");
 }
 
 void table_init(Table* table, Environment* env)
 {
-	map_init(table, 0,
-	         sizeof(struct key), sizeof(struct val), comp, hash,
-	         (struct allocator){ .method = table_malloc, .environment = env });
+	*table = (Table){ .env = env };
 }
 
 void table_destroy(Table* table)
 {
-	map_destroy(table);
+	reallocate(table->env, table->entries, 0, "Table");
+	table_init(table, table->env);
 }
 
-bool table_get(const Table* table, const ObjString* k, Value* value)
+bool table_get(const Table* table, const ObjString* key, Value* value)
 {
-	struct key key = { .str = k->chars, .length = k->length, .hash = k->hash };
-	const struct val* found = map_get(table, &key);
-	if (found == NULL) return false;
-	*value = found->value;
+	const struct TableEntry* entry = find_entry(table, key, obj_string_hash(key));
+	if (entry == NULL) return false;
+	*value = entry->value;
 	return true;
 }
 
 ObjString* table_find_string(const Table* table, const char* str, size_t length,
                              hash_t hash)
 {
-	struct key key = { .str = str, .length = length, .hash = hash };
-	const struct val* found = map_get(table, &key);
-	return found != NULL ? found->string : NULL;
+	if (table->capacity == 0)
+		return NULL;
+
+	const size_t mask = table->capacity - 1;
+	const uint8_t tag = probe_tag(hash);
+	for (size_t pos = probe_start(table, hash);; pos = (pos + GROUP_SIZE) & mask) {
+		const uint64_t group = group_load(&table->control[pos]);
+		for (uint64_t match = group_match(group, tag); match != 0; match &= match - 1) {
+			ObjString* key = table->entries[(pos + first_byte(match)) & mask].key;
+			if (key->length == length && key->obj.hash == hash
+			    && memcmp(key->chars, str, length) == 0)
+				return key;
+		}
+		if (group_match_empty(group) != 0)
+			return NULL;
+	}
+}
+
+#if FAST_STRING_HASH
+// Multiplies A and B into a 128-bit result, whose halves are written back to them.
+static inline void mum(uint64_t* a, uint64_t* b)
+{
+#ifdef __SIZEOF_INT128__
+	const __uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	const uint64_t ha = *a >> 32, hb = *b >> 32;
+	const uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+	const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	const uint64_t t = rl + (rm0 << 32);
+	const uint64_t lo = t + (rm1 << 32);
+	const uint64_t carry = (t < rl) + (lo < t);
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+	mum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t read8(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read4(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Reads 1 to 3 bytes, touching every one of them.
+static inline uint64_t read3(const uint8_t* p, size_t n)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
 }
 
-extern inline hash_t table_hash(const void* ptr, size_t n);
+// Same algorithm (and secrets) as wyhash's final version 4, with a fixed seed.
+hash_t table_hash(const void* ptr, size_t n)
+{
+	static const uint64_t secret[4] = {
+		0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+		0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+	};
+
+	const uint8_t* p = (const uint8_t*)ptr;
+	uint64_t seed = 0xca813bf4c7abf0a9ull; // mix(secret[0], secret[1]), for a seed of 0
+	uint64_t a, b;
+	if (n <= 16) {
+		if (n >= 4) {
+			const size_t k = (n >> 3) << 2;
+			a = (read4(p) << 32) | read4(p + k);
+			b = (read4(p + n - 4) << 32) | read4(p + n - 4 - k);
+		} else if (n > 0) {
+			a = read3(p, n);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = n;
+		if (i >= 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+				seed1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ seed1);
+				seed2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (i > 16) {
+			seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		a = read8(p + i - 16);
+		b = read8(p + i - 8);
+	}
+
+	a ^= secret[1];
+	b ^= seed;
+	mum(&a, &b);
+	return (uint32_t)mix(a ^ secret[0] ^ n, b ^ secret[1]);
+}
+#else
+hash_t table_hash(const void* ptr, size_t n)
+{
+	return (uint32_t)fnv_1a(ptr, n);
+}
+#endif
 
 bool table_put(Table* table, const ObjString* k, Value value)
 {
-	struct key key = { .str = k->chars, .length = k->length, .hash = k->hash };
-	struct val val = { .string = (ObjString*)k, .value = value };
-	return map_insert(table, &key, &val) < 0;
+	const hash_t hash = obj_string_hash(k);
+	struct TableEntry* entry = find_entry(table, k, hash);
+	if (entry != NULL) {
+		entry->value = value;
+		return true;
+	}
+
+	if (table->used + 1 > max_load(table->capacity)) {
+		// only grows when getting rid of tombstones wouldn't make enough room
+		size_t capacity = table->capacity < MIN_CAPACITY ? MIN_CAPACITY : table->capacity;
+		if (table->count + 1 > max_load(capacity) / 2) capacity *= 2;
+		resize(table, capacity);
+	}
+
+	const size_t slot = find_slot(table, hash);
+	if (table->control[slot] == CONTROL_EMPTY) table->used++;
+	table->count++;
+	set_control(table, slot, probe_tag(hash));
+	table->entries[slot] = (struct TableEntry){ .key = (ObjString*)k, .value = value };
+	return false;
 }
 
 bool table_delete(Table* table, const ObjString* k)
 {
-	struct key key = { .str = k->chars, .length = k->length, .hash = k->hash };
-	return map_remove(table, &key) == 0;
+	struct TableEntry* entry = find_entry(table, k, obj_string_hash(k));
+	if (entry == NULL)
+		return false;
+
+	set_control(table, entry - table->entries, CONTROL_DELETED);
+	entry->key = NULL;
+	table->count--;
+	table_shrink(table);
+	return true;
+}
+
+size_t table_delete_if(Table* table,
+                       bool (*predicate)(const ObjString*, Value*, void*),
+                       void* forward)
+{
+	size_t deleted = 0;
+	for (size_t i = 0; i < table->capacity; ++i) {
+		if (table->control[i] & CONTROL_EMPTY) continue;
+		struct TableEntry* entry = &table->entries[i];
+		if (!predicate(entry->key, &entry->value, forward)) continue;
+		set_control(table, i, CONTROL_DELETED);
+		entry->key = NULL;
+		deleted++;
+	}
+	table->count -= deleted;
+	return deleted;
 }
 
-static err_t for_each_adaptor(const void* key, void* value, void* forward)
+void table_shrink(Table* table)
 {
-	const struct for_each_closure* adaptor = (struct for_each_closure*)forward;
-	struct val* entry = (struct val*)value;
-	adaptor->func(entry->string, &entry->value, adaptor->forward);
-	return 0;
+	if (table->capacity <= MIN_CAPACITY || table->count >= min_load(table->capacity))
+		return;
+
+	size_t capacity = table->capacity;
+	while (capacity > MIN_CAPACITY && table->count < min_load(capacity))
+		capacity /= 2;
+	resize(table, table->count > 0 ? capacity : 0);
 }
 
 void table_for_each(const Table* table,
                     void (*func)(const ObjString*, Value*, void*),
                     void* forward)
 {
-	struct for_each_closure adaptor = { .func = func, .forward = forward };
-	map_for_each(table, for_each_adaptor, &adaptor);
+	for (size_t i = 0; i < table->capacity; ++i) {
+		if (table->control[i] & CONTROL_EMPTY) continue;
+		func(table->entries[i].key, &table->entries[i].value, forward);
+	}
 }
+
+void table_for_each_entry(Table* table,
+                          void (*func)(ObjString**, Value*, void*),
+                          void* forward)
+{
+	for (size_t i = 0; i < table->capacity; ++i) {
+		if (table->control[i] & CONTROL_EMPTY) continue;
+		func(&table->entries[i].key, &table->entries[i].value, forward);
+	}
+}
+
+#undef GROUP_SIZE
+#undef MIN_CAPACITY
+#undef CONTROL_EMPTY
+#undef CONTROL_DELETED
+#undef LSBS
+#undef MSBS
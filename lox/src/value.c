@@ -1,13 +1,16 @@
 #include "value.h"
 
-#include <stdio.h>
 #include <string.h> // memcmp
 
 #include "object.h"
 #include "memory.h" // reallocate
+#include "number.h" // number_format
 
 
 extern inline Value number_value(double number);
+extern inline Value int_value(int32_t number);
+extern inline bool value_is_int(Value value);
+extern inline int32_t value_as_int(Value value);
 extern inline double value_as_number(Value value);
 extern inline bool value_is_number(Value value);
 extern inline Value nil_value(void);
@@ -18,38 +21,90 @@ extern inline bool value_is_bool(Value value);
 extern inline Value obj_value(Obj* object);
 extern inline Obj* value_as_obj(Value value);
 extern inline bool value_is_obj(Value value);
+extern inline Value number_value_compact(double number);
 
-void value_print(Value value)
+// Formats integer NUMBER in BUFFER, without going through printf.
+static int format_int(int32_t number, char buffer[VALUE_NUMBER_MAX])
+{
+	char digits[12];
+	int n = 0;
+	uint32_t magnitude = number < 0 ? -(uint32_t)number : (uint32_t)number;
+	do {
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+
+	int length = 0;
+	if (number < 0) buffer[length++] = '-';
+	while (n > 0) buffer[length++] = digits[--n];
+	buffer[length] = '\0';
+	return length;
+}
+
+int value_format_number(Value value, char buffer[VALUE_NUMBER_MAX])
+{
+	if (value_is_int(value))
+		return format_int(value_as_int(value), buffer);
+	return number_format(value_as_number(value), buffer);
+}
+
+void value_write(Value value, Output* out)
 {
+	char buffer[VALUE_NUMBER_MAX];
 #if NAN_BOXING
-	if (value_is_bool(value)) printf(value_as_bool(value) ? "true" : "false");
-	else if (value_is_nil(value)) printf("nil");
-	else if (value_is_number(value)) printf("%g", value_as_number(value));
-	else if (value_is_obj(value)) obj_print(value);
+	if (value_is_bool(value)) output_str(out, value_as_bool(value) ? "true" : "false");
+	else if (value_is_nil(value)) output_str(out, "nil");
+	else if (value_is_number(value)) output_write(out, buffer, value_format_number(value, buffer));
+	else if (value_is_obj(value)) obj_write(value, out);
 #else
 	switch (value.type) {
-		case VAL_BOOL: printf(value_as_bool(value) ? "true" : "false"); break;
-		case VAL_NIL: printf("nil"); break;
-		case VAL_NUMBER: printf("%g", value_as_number(value)); break;
-		case VAL_OBJ: obj_print(value); break;
+		case VAL_BOOL: output_str(out, value_as_bool(value) ? "true" : "false"); break;
+		case VAL_NIL: output_str(out, "nil"); break;
+		case VAL_NUMBER: output_write(out, buffer, value_format_number(value, buffer)); break;
+		case VAL_OBJ: obj_write(value, out); break;
 	}
 #endif
 }
 
+void value_print(Value value)
+{
+	char buffer[256];
+	Output out;
+	output_init(&out, buffer, sizeof(buffer));
+	value_write(value, &out);
+	output_flush(&out);
+}
+
+static bool methods_equal(const ObjBoundMethod* a, const ObjBoundMethod* b)
+{
+	return a->method == b->method && value_equal(a->receiver, b->receiver);
+}
+
 bool value_equal(Value a, Value b)
 {
 #if NAN_BOXING
-	return value_is_number(a) && value_is_number(b)
-	     ? value_as_number(a) == value_as_number(b)
-	     : a == b;
+	if (value_is_int(a) && value_is_int(b))
+		return a == b;
+	else if (value_is_number(a) && value_is_number(b))
+		return value_as_number(a) == value_as_number(b);
+	else if (a != b && value_is_string(a) && value_is_string(b))
+		return obj_string_equal(value_as_string(a), value_as_string(b));
+	else if (a != b && value_is_method(a) && value_is_method(b))
+		return methods_equal(value_as_method(a), value_as_method(b));
+	else
+		return a == b;
 #else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 		case VAL_BOOL: return value_as_bool(a) == value_as_bool(b);
 		case VAL_NIL: return true;
 		case VAL_NUMBER: return value_as_number(a) == value_as_number(b);
-		// @NOTE: this works because all strings are interned
-		case VAL_OBJ: return value_as_string(a) == value_as_string(b);
+		case VAL_OBJ:
+			if (value_is_string(a) && value_is_string(b))
+				return obj_string_equal(value_as_string(a), value_as_string(b));
+			else if (value_is_method(a) && value_is_method(b))
+				return methods_equal(value_as_method(a), value_as_method(b));
+			return value_as_obj(a) == value_as_obj(b);
 	}
 #endif
 }
@@ -73,4 +128,5 @@ void value_array_destroy(ValueArray* array)
 
 extern inline int value_array_size(const ValueArray* array);
 extern inline Value value_array_get(const ValueArray* array, int index);
+extern inline void value_array_set(ValueArray* array, int index, Value value);
 extern inline void value_array_write(ValueArray* array, Value value);
@@ -2,7 +2,7 @@
 
 #include <stdio.h>
 #include <stdarg.h> // varargs
-#include <string.h> // strlen
+#include <string.h> // strlen, strcmp, memcpy, memmove, memcmp, memchr
 #include <time.h> // clock(), CLOCKS_PER_SEC
 #include <assert.h>
 
@@ -14,7 +14,13 @@
 #include "object.h" // free_objects
 #include "compiler.h"
 #include "table.h"
-#include "common.h" // GC_HEAP_INITIAL, COMPUTED_GOTO
+#include "map.h"
+#include "kernels.h" // f64_sort
+#include "output.h"
+#include "number.h"
+#include "heap.h"
+#include "memory.h" // compact_garbage
+#include "common.h" // GC_HEAP_INITIAL, GC_COMPACTION, COMPUTED_GOTO, METHOD_CACHE_SIZE, FILE_BUFFER_SIZE
 #if DEBUG_TRACE_EXECUTION
 #	include "debug.h" // disassemble_instruction
 #endif
@@ -23,9 +29,9 @@
 int constant_add(ValueArray* constants, Value value)
 {
 	const int index = value_array_size(constants);
-	if (value_is_obj(value)) value_as_obj(value)->marked = true;
+	if (value_is_obj(value)) heap_mark(value_as_obj(value));
 	value_array_write(constants, value);
-	if (value_is_obj(value)) value_as_obj(value)->marked = false;
+	if (value_is_obj(value)) heap_unmark(value_as_obj(value));
 	return index;
 }
 
@@ -41,22 +47,30 @@ static void reset_stack(VM* vm)
 }
 
 static void define_native(VM* vm, const char* name, NativeFn function);
+static bool call_from_native(VM* vm, Value callee, Value arg, Value* result);
 
-static bool native_clock(int argc, Value argv[])
+static bool native_clock(Environment* env, int argc, Value argv[])
 {
 	if (argc != 0) return false;
 	argv[-1] = number_value((double)clock() / CLOCKS_PER_SEC);
 	return true;
 }
 
-static bool native_error(int argc, Value argv[])
+static bool native_flush(Environment* env, int argc, Value argv[])
+{
+	if (argc != 0) return false;
+	output_flush(&env->vm->output);
+	return true;
+}
+
+static bool native_error(Environment* env, int argc, Value argv[])
 {
 	if (argc == 1)
 		argv[-1] = argv[0];
 	return false;
 }
 
-static bool native_hasField(int argc, Value argv[])
+static bool native_hasField(Environment* env, int argc, Value argv[])
 {
 	if (argc != 2) return false;
 	else if (!value_is_instance(argv[0])) return false;
@@ -65,11 +79,11 @@ static bool native_hasField(int argc, Value argv[])
 	ObjInstance* instance = value_as_instance(argv[0]);
 	const ObjString* field = value_as_string(argv[1]);
 	Value dummy;
-	argv[-1] = bool_value(table_get(&instance->fields, field, &dummy));
+	argv[-1] = bool_value(obj_instance_get(instance, field, &dummy));
 	return true;
 }
 
-static bool native_getField(int argc, Value argv[])
+static bool native_getField(Environment* env, int argc, Value argv[])
 {
 	if (argc != 2) return false;
 	else if (!value_is_instance(argv[0])) return false;
@@ -77,24 +91,24 @@ static bool native_getField(int argc, Value argv[])
 
 	ObjInstance* instance = value_as_instance(argv[0]);
 	const ObjString* field = value_as_string(argv[1]);
-	table_get(&instance->fields, field, &argv[-1]);
+	obj_instance_get(instance, field, &argv[-1]);
 	return true;
 }
 
-static bool native_setField(int argc, Value argv[])
+static bool native_setField(Environment* env, int argc, Value argv[])
 {
 	if (argc != 3) return false;
 	else if (!value_is_instance(argv[0])) return false;
 	else if (!value_is_string(argv[1])) return false;
 
 	ObjInstance* instance = value_as_instance(argv[0]);
-	const ObjString* field = value_as_string(argv[1]);
-	table_put(&instance->fields, field, argv[2]);
+	ObjString* field = value_as_string(argv[1]);
+	obj_instance_set(env, instance, field, argv[2]);
 	argv[-1] = argv[2];
 	return true;
 }
 
-static bool native_deleteField(int argc, Value argv[])
+static bool native_deleteField(Environment* env, int argc, Value argv[])
 {
 	if (argc != 2) return false;
 	else if (!value_is_instance(argv[0])) return false;
@@ -102,23 +116,794 @@ static bool native_deleteField(int argc, Value argv[])
 
 	ObjInstance* instance = value_as_instance(argv[0]);
 	const ObjString* field = value_as_string(argv[1]);
-	table_delete(&instance->fields, field);
+	obj_instance_delete(instance, field);
+	return true;
+}
+
+// Gets the position in a sequence of LENGTH items which is at INDEX, or -1 when there's none.
+static int index_of(Value index, int length)
+{
+	if (value_is_int(index))
+		return value_as_int(index) >= 0 && value_as_int(index) < length ? value_as_int(index) : -1;
+	else if (!value_is_number(index))
+		return -1;
+
+	const double number = value_as_number(index);
+	return number >= 0 && number < length && number == (int)number ? (int)number : -1;
+}
+
+static bool native_length(Environment* env, int argc, Value argv[])
+{
+	size_t length;
+	if (argc != 1) return false;
+	else if (value_is_list(argv[0])) length = value_as_list(argv[0])->count;
+	else if (value_is_map(argv[0])) length = value_as_map(argv[0])->map.count;
+	else if (value_is_float64_array(argv[0])) length = value_as_float64_array(argv[0])->count;
+	else if (value_is_bytes(argv[0])) length = value_as_bytes(argv[0])->length;
+	else if (value_is_string(argv[0])) length = value_as_string(argv[0])->length;
+	else return false;
+	argv[-1] = number_value_compact((double)length);
+	return true;
+}
+
+static bool bytes_append(Environment* env, ObjBytes* bytes, Value value);
+
+static bool native_append(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (value_is_bytes(argv[0])) return bytes_append(env, value_as_bytes(argv[0]), argv[1]);
+	else if (!value_is_list(argv[0])) return false;
+
+	ObjList* list = value_as_list(argv[0]);
+	obj_list_insert(env, list, list->count, argv[1]);
+	return true;
+}
+
+static bool native_listInsert(Environment* env, int argc, Value argv[])
+{
+	if (argc != 3) return false;
+	else if (!value_is_list(argv[0])) return false;
+
+	ObjList* list = value_as_list(argv[0]);
+	const int index = index_of(argv[1], list->count + 1); // may insert at the end
+	if (index < 0) return false;
+
+	obj_list_insert(env, list, index, argv[2]);
+	return true;
+}
+
+static bool native_listRemove(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_list(argv[0])) return false;
+
+	ObjList* list = value_as_list(argv[0]);
+	const int index = index_of(argv[1], list->count);
+	if (index < 0) return false;
+
+	argv[-1] = obj_list_remove(list, index);
+	return true;
+}
+
+static bool native_deleteKey(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_map(argv[0])) return false;
+
+	value_map_delete(&value_as_map(argv[0])->map, argv[1], &argv[-1]);
+	return true;
+}
+
+static bool native_hasKey(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_map(argv[0])) return false;
+
+	Value value;
+	argv[-1] = bool_value(value_map_get(&value_as_map(argv[0])->map, argv[1], &value));
+	return true;
+}
+
+static void append_key(Value* key, Value* value, void* list)
+{
+	ObjList* keys = (ObjList*)list;
+	keys->items[keys->count++] = *key;
+}
+
+static void append_value(Value* key, Value* value, void* list)
+{
+	ObjList* values = (ObjList*)list;
+	values->items[values->count++] = *value;
+}
+
+// Puts a list with either the keys or the values of a map in ARGV[-1], in insertion order.
+static bool map_to_list(Environment* env, int argc, Value argv[],
+                        void (*append)(Value*, Value*, void*))
+{
+	if (argc != 1) return false;
+	else if (!value_is_map(argv[0])) return false;
+
+	ObjList* list = make_obj_list(env);
+	argv[-1] = obj_value((Obj*)list);
+	ValueMap* map = &value_as_map(argv[0])->map;
+	obj_list_reserve(env, list, map->count);
+	value_map_for_each(map, append, list);
+	return true;
+}
+
+static bool native_keys(Environment* env, int argc, Value argv[])
+{
+	return map_to_list(env, argc, argv, append_key);
+}
+
+static bool native_values(Environment* env, int argc, Value argv[])
+{
+	return map_to_list(env, argc, argv, append_value);
+}
+
+// Float64Array(n) makes an array of N zeros, Float64Array(list) one with the numbers in LIST.
+static bool native_Float64Array(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+
+	if (value_is_number(argv[0])) {
+		const double count = value_as_number(argv[0]);
+		if (!(count >= 0 && count <= INT32_MAX && count == (int)count)) return false;
+		argv[-1] = obj_value((Obj*)make_obj_float64_array(env, (int)count));
+		return true;
+	} else if (!value_is_list(argv[0])) {
+		return false;
+	}
+
+	ObjFloat64Array* array = make_obj_float64_array(env, value_as_list(argv[0])->count);
+	const ObjList* list = value_as_list(argv[0]);
+	for (int i = 0; i < list->count; ++i) {
+		if (!value_is_number(list->items[i])) return false;
+		array->items[i] = value_as_number(list->items[i]);
+	}
+	argv[-1] = obj_value((Obj*)array);
+	return true;
+}
+
+static bool native_f64Sum(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_float64_array(argv[0])) return false;
+
+	const ObjFloat64Array* array = value_as_float64_array(argv[0]);
+	argv[-1] = number_value(env->vm->kernels->sum(array->items, array->count));
+	return true;
+}
+
+static bool native_f64Dot(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_float64_array(argv[0]) || !value_is_float64_array(argv[1])) return false;
+
+	const ObjFloat64Array* a = value_as_float64_array(argv[0]);
+	const ObjFloat64Array* b = value_as_float64_array(argv[1]);
+	if (a->count != b->count) return false;
+
+	argv[-1] = number_value(env->vm->kernels->dot(a->items, b->items, a->count));
+	return true;
+}
+
+static bool native_f64Scale(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_float64_array(argv[0]) || !value_is_number(argv[1])) return false;
+
+	ObjFloat64Array* array = value_as_float64_array(argv[0]);
+	env->vm->kernels->scale(array->items, value_as_number(argv[1]), array->count);
+	return true;
+}
+
+static bool native_f64Add(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_float64_array(argv[0]) || !value_is_float64_array(argv[1])) return false;
+
+	ObjFloat64Array* a = value_as_float64_array(argv[0]);
+	const ObjFloat64Array* b = value_as_float64_array(argv[1]);
+	if (a->count != b->count) return false;
+
+	env->vm->kernels->add(a->items, b->items, a->count);
+	return true;
+}
+
+static bool native_f64Min(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_float64_array(argv[0])) return false;
+
+	const ObjFloat64Array* array = value_as_float64_array(argv[0]);
+	if (array->count > 0)
+		argv[-1] = number_value(env->vm->kernels->min(array->items, array->count));
+	return true;
+}
+
+static bool native_f64Max(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_float64_array(argv[0])) return false;
+
+	const ObjFloat64Array* array = value_as_float64_array(argv[0]);
+	if (array->count > 0)
+		argv[-1] = number_value(env->vm->kernels->max(array->items, array->count));
+	return true;
+}
+
+static bool native_f64Sort(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_float64_array(argv[0])) return false;
+
+	ObjFloat64Array* array = value_as_float64_array(argv[0]);
+	f64_sort(array->items, array->count);
+	return true;
+}
+
+// Appends to BYTES either a single byte, or all bytes in a string or in another buffer.
+static bool bytes_append(Environment* env, ObjBytes* bytes, Value value)
+{
+	if (value_is_string(value)) {
+		const ObjString* string = value_as_string(value);
+		if (string->length > (size_t)(INT32_MAX - bytes->length)) return false;
+		obj_bytes_append(env, bytes, (const uint8_t*)string->chars, (int)string->length);
+	} else if (value_is_bytes(value)) {
+		const ObjBytes* other = value_as_bytes(value);
+		if (other->length > INT32_MAX - bytes->length) return false;
+		obj_bytes_append(env, bytes, obj_bytes_data(other), other->length);
+	} else {
+		const int byte = index_of(value, 256); // any integer from 0 to 255
+		if (byte < 0) return false;
+		const uint8_t data = (uint8_t)byte;
+		obj_bytes_append(env, bytes, &data, 1);
+	}
+	return true;
+}
+
+// Bytes(n) makes a buffer of N zeros, Bytes(string) or Bytes(list) one with their bytes.
+static bool native_Bytes(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+
+	if (value_is_number(argv[0])) {
+		const double length = value_as_number(argv[0]);
+		if (!(length >= 0 && length <= INT32_MAX && length == (int)length)) return false;
+		argv[-1] = obj_value((Obj*)make_obj_bytes(env, (int)length));
+		return true;
+	} else if (value_is_string(argv[0])) {
+		if (value_as_string(argv[0])->length > INT32_MAX) return false;
+		ObjBytes* bytes = make_obj_bytes(env, (int)value_as_string(argv[0])->length);
+		memcpy(bytes->data, value_as_c_str(argv[0]), bytes->length);
+		argv[-1] = obj_value((Obj*)bytes);
+		return true;
+	} else if (!value_is_list(argv[0])) {
+		return false;
+	}
+
+	ObjBytes* bytes = make_obj_bytes(env, value_as_list(argv[0])->count);
+	const ObjList* list = value_as_list(argv[0]);
+	for (int i = 0; i < list->count; ++i) {
+		const int byte = index_of(list->items[i], 256);
+		if (byte < 0) return false;
+		bytes->data[i] = (uint8_t)byte;
+	}
+	argv[-1] = obj_value((Obj*)bytes);
+	return true;
+}
+
+// slice(bytes, start, end) views the bytes from START up to (but not including) END, without copying.
+static bool native_slice(Environment* env, int argc, Value argv[])
+{
+	if (argc != 3) return false;
+	else if (!value_is_bytes(argv[0])) return false;
+
+	ObjBytes* bytes = value_as_bytes(argv[0]);
+	const int start = index_of(argv[1], bytes->length + 1);
+	const int end = index_of(argv[2], bytes->length + 1);
+	if (start < 0 || end < start) return false;
+
+	argv[-1] = obj_value((Obj*)make_obj_bytes_slice(env, bytes, start, end - start));
+	return true;
+}
+
+static bool native_toString(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+
+	if (value_is_number(argv[0])) {
+		char buffer[VALUE_NUMBER_MAX];
+		const int length = value_format_number(argv[0], buffer);
+		argv[-1] = obj_value((Obj*)make_obj_string(env, buffer, length));
+		return true;
+	} else if (!value_is_bytes(argv[0])) {
+		return false;
+	}
+
+	const ObjBytes* bytes = value_as_bytes(argv[0]);
+	argv[-1] = obj_value((Obj*)make_obj_string_uninterned(env, (const char*)obj_bytes_data(bytes), bytes->length));
+	return true;
+}
+
+// Parses a string as a number, giving nil when it isn't one.
+static bool native_toNumber(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_string(argv[0])) return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	double number;
+	if (number_parse(string->chars, string->length, &number))
+		argv[-1] = number_value_compact(number);
+	return true;
+}
+
+// Finds the first occurrence of NEEDLE in HAYSTACK, with memchr skipping ahead to candidates.
+static const char* find_string(const char* haystack, size_t length, const char* needle, size_t n)
+{
+	if (n == 0) return haystack;
+	const char* const end = haystack + length;
+	for (const char* p = haystack; (size_t)(end - p) >= n; ++p) {
+		p = memchr(p, needle[0], (size_t)(end - p) - n + 1);
+		if (p == NULL) return NULL;
+		else if (memcmp(p + 1, needle + 1, n - 1) == 0) return p;
+	}
+	return NULL;
+}
+
+// Gets the position at INDEX in STRING, counting its end, or -1 when there's none.
+static int string_position(Value index, const ObjString* string)
+{
+	return string->length < INT32_MAX ? index_of(index, (int)string->length + 1) : -1;
+}
+
+/* substring(s, start, end) gets the chars from START up to (but not including)
+END, which are only copied when few, and shared with S otherwise. */
+static bool native_substring(Environment* env, int argc, Value argv[])
+{
+	if (argc != 3) return false;
+	else if (!value_is_string(argv[0])) return false;
+
+	ObjString* string = value_as_string(argv[0]);
+	const int start = string_position(argv[1], string);
+	const int end = string_position(argv[2], string);
+	if (start < 0 || end < start) return false;
+
+	if ((size_t)(end - start) == string->length)
+		argv[-1] = argv[0]; // strings are immutable, so there's no need to copy
+	else
+		argv[-1] = obj_value(obj_string_slice(env, string, start, end - start));
+	return true;
+}
+
+// indexOf(s, needle) or indexOf(s, needle, from) gets the position of NEEDLE in S, or -1.
+static bool native_indexOf(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2 && argc != 3) return false;
+	else if (!value_is_string(argv[0]) || !value_is_string(argv[1])) return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	const ObjString* needle = value_as_string(argv[1]);
+	const int from = argc == 3 ? string_position(argv[2], string) : 0;
+	if (from < 0) return false;
+
+	const char* found = find_string(string->chars + from, string->length - from,
+	                                needle->chars, needle->length);
+	argv[-1] = number_value_compact(found != NULL ? found - string->chars : -1);
+	return true;
+}
+
+static bool native_startsWith(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_string(argv[0]) || !value_is_string(argv[1])) return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	const ObjString* prefix = value_as_string(argv[1]);
+	argv[-1] = bool_value(prefix->length <= string->length
+	                      && memcmp(string->chars, prefix->chars, prefix->length) == 0);
+	return true;
+}
+
+/* split(s, separator) gets a list of the strings between each SEPARATOR in S, or
+of each of its chars when SEPARATOR is empty. Pieces are counted beforehand, so
+that the list only gets allocated once. */
+static bool native_split(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_string(argv[0]) || !value_is_string(argv[1])) return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	const ObjString* separator = value_as_string(argv[1]);
+	const char* const end = string->chars + string->length;
+	const size_t step = separator->length > 0 ? separator->length : 1;
+
+	size_t count = separator->length > 0 ? 1 : string->length;
+	if (separator->length > 0) {
+		for (const char* p = string->chars;
+		     (p = find_string(p, end - p, separator->chars, separator->length)) != NULL;
+		     p += step)
+			++count;
+	}
+	if (count > INT32_MAX) return false;
+
+	ObjList* list = make_obj_list(env);
+	argv[-1] = obj_value((Obj*)list);
+	obj_list_reserve(env, list, (int)count);
+
+	// the list already has room for every piece, so each one is reachable right away
+	const char* start = string->chars;
+	for (size_t i = 0; i < count; ++i) {
+		const char* stop = start + 1;
+		if (i + 1 == count)
+			stop = end;
+		else if (separator->length > 0)
+			stop = find_string(start, end - start, separator->chars, separator->length);
+
+		ObjString* piece = make_obj_string_uninterned(env, start, stop - start);
+		list->items[list->count++] = obj_value((Obj*)piece);
+		start = stop + separator->length;
+	}
+	return true;
+}
+
+// join(list, separator) concatenates the strings in LIST, with SEPARATOR between each of them.
+static bool native_join(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_list(argv[0]) || !value_is_string(argv[1])) return false;
+
+	// ropes are flattened first, so that nothing else needs to allocate after the result
+	const ObjList* list = value_as_list(argv[0]);
+	for (int i = 0; i < list->count; ++i) {
+		if (value_is_rope(list->items[i]))
+			list->items[i] = obj_value((Obj*)obj_rope_flatten(env, value_as_rope(list->items[i])));
+		else if (!value_is_string(list->items[i]))
+			return false;
+	}
+
+	const ObjString* separator = value_as_string(argv[1]);
+	size_t length = list->count > 0 ? (list->count - 1) * separator->length : 0;
+	for (int i = 0; i < list->count; ++i)
+		length += value_as_string(list->items[i])->length;
+
+	ObjString* result = make_obj_string_buffer(env, length);
+	char* out = result->chars;
+	for (int i = 0; i < list->count; ++i) {
+		if (i > 0) {
+			memcpy(out, separator->chars, separator->length);
+			out += separator->length;
+		}
+		const ObjString* item = value_as_string(list->items[i]);
+		memcpy(out, item->chars, item->length);
+		out += item->length;
+	}
+	argv[-1] = obj_value((Obj*)result);
+	return true;
+}
+
+// replace(s, old, new) replaces every occurrence of OLD in S with NEW.
+static bool native_replace(Environment* env, int argc, Value argv[])
+{
+	if (argc != 3) return false;
+	else if (!value_is_string(argv[0]) || !value_is_string(argv[1]) || !value_is_string(argv[2]))
+		return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	const ObjString* old = value_as_string(argv[1]);
+	const ObjString* new = value_as_string(argv[2]);
+	const char* const end = string->chars + string->length;
+
+	size_t count = 0;
+	if (old->length > 0) {
+		for (const char* p = string->chars;
+		     (p = find_string(p, end - p, old->chars, old->length)) != NULL;
+		     p += old->length)
+			++count;
+	}
+	if (count == 0) {
+		argv[-1] = argv[0];
+		return true;
+	}
+
+	ObjString* result = make_obj_string_buffer(env, string->length - count * old->length + count * new->length);
+	char* out = result->chars;
+	const char* start = string->chars;
+	for (size_t i = 0; i < count; ++i) {
+		const char* found = find_string(start, end - start, old->chars, old->length);
+		memcpy(out, start, found - start);
+		out += found - start;
+		memcpy(out, new->chars, new->length);
+		out += new->length;
+		start = found + old->length;
+	}
+	memcpy(out, start, end - start);
+	argv[-1] = obj_value((Obj*)result);
+	return true;
+}
+
+// Copies STRING into ARGV[-1], with its ASCII letters from FIRST to LAST shifted by DELTA.
+static bool change_case(Environment* env, int argc, Value argv[], char first, char last, int delta)
+{
+	if (argc != 1) return false;
+	else if (!value_is_string(argv[0])) return false;
+
+	const ObjString* string = value_as_string(argv[0]);
+	ObjString* result = make_obj_string_buffer(env, string->length);
+	for (size_t i = 0; i < string->length; ++i) {
+		const char c = string->chars[i];
+		result->chars[i] = c >= first && c <= last ? (char)(c + delta) : c;
+	}
+	argv[-1] = obj_value((Obj*)result);
+	return true;
+}
+
+static bool native_toUpper(Environment* env, int argc, Value argv[])
+{
+	return change_case(env, argc, argv, 'a', 'z', 'A' - 'a');
+}
+
+static bool native_toLower(Environment* env, int argc, Value argv[])
+{
+	return change_case(env, argc, argv, 'A', 'Z', 'a' - 'A');
+}
+
+// openFile(path, mode) opens a file for reading ("r"), writing ("w") or appending ("a"), or gives nil.
+static bool native_openFile(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_string(argv[0]) || !value_is_string(argv[1])) return false;
+
+	const char* mode = value_as_c_str(argv[1]);
+	const char* stdio_mode = strcmp(mode, "r") == 0 ? "rb"
+	                       : strcmp(mode, "w") == 0 ? "wb"
+	                       : strcmp(mode, "a") == 0 ? "ab"
+	                       : NULL;
+	if (stdio_mode == NULL) return false;
+
+	FILE* stream = fopen(value_as_c_str(argv[0]), stdio_mode);
+	if (stream != NULL)
+		argv[-1] = obj_value((Obj*)make_obj_file(env, stream, mode[0] != 'r'));
+	return true;
+}
+
+// Gets the open file in VALUE, as long as it was opened for WRITING or not.
+static ObjFile* open_file(Value value, bool writing)
+{
+	if (!value_is_file(value)) return NULL;
+	ObjFile* file = value_as_file(value);
+	return file->stream != NULL && file->writing == writing ? file : NULL;
+}
+
+// readLine(file) gets the next line from FILE, without its newline, or nil at its end.
+static bool native_readLine(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	ObjFile* file = open_file(argv[0], false);
+	if (file == NULL) return false;
+
+	ObjString* line = obj_file_read_line(env, file);
+	if (line != NULL)
+		argv[-1] = obj_value((Obj*)line);
+	return true;
+}
+
+// readChunk(file, n) gets the next N bytes from FILE as a string (fewer at its end), or nil after it.
+static bool native_readChunk(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_number(argv[1])) return false;
+	ObjFile* file = open_file(argv[0], false);
+	const double n = value_as_number(argv[1]);
+	if (file == NULL || !(n >= 1 && n <= INT32_MAX && n == (int)n)) return false;
+
+	// the buffer only grows (up to N) while it keeps filling up, so asking for more than is left costs nothing
+	const size_t limit = (size_t)n;
+	size_t capacity = limit < FILE_BUFFER_SIZE ? limit : FILE_BUFFER_SIZE;
+	char* buffer = reallocate(env, NULL, capacity, "buffer[]");
+	size_t length = 0;
+	for (size_t read; (read = obj_file_read(env, file, buffer + length, capacity - length)) > 0;) {
+		length += read;
+		if (length < capacity || capacity == limit) break;
+		const size_t grown = 2 * capacity < limit ? 2 * capacity : limit;
+		buffer = reallocate(env, buffer, grown, "buffer[]");
+		capacity = grown;
+	}
+	if (length > 0)
+		argv[-1] = obj_value((Obj*)make_obj_string_uninterned(env, buffer, length));
+	else
+		argv[-1] = nil_value();
+	reallocate(env, buffer, 0, "buffer[]");
+	return true;
+}
+
+// Gets the contents of VALUE when it's a string or bytes, which files can be written.
+static bool data_of(Value value, const char** data, size_t* length)
+{
+	if (value_is_string(value)) {
+		*data = value_as_c_str(value);
+		*length = value_as_string(value)->length;
+	} else if (value_is_bytes(value)) {
+		*data = (const char*)obj_bytes_data(value_as_bytes(value));
+		*length = value_as_bytes(value)->length;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// writeChunk(file, data) writes the string or bytes in DATA to FILE.
+static bool native_writeChunk(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	ObjFile* file = open_file(argv[0], true);
+	const char* data;
+	size_t length;
+	if (file == NULL || !data_of(argv[1], &data, &length)) return false;
+
+	output_write(&file->output, data, length);
+	return true;
+}
+
+// closeFile(file) closes FILE, giving whether everything was read or written successfully.
+static bool native_closeFile(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_file(argv[0]) || value_as_file(argv[0])->stream == NULL) return false;
+
+	argv[-1] = bool_value(obj_file_close(env, value_as_file(argv[0])));
+	return true;
+}
+
+/** Reads everything left in STREAM into a new buffer, setting its LENGTH. The
+ * buffer starts with room for CAPACITY bytes, and doubles whenever it's full. */
+static char* read_rest(Environment* env, FILE* stream, size_t capacity, size_t* length)
+{
+	char* buffer = reallocate(env, NULL, capacity, "buffer[]");
+	*length = 0;
+	for (size_t n; (n = fread(buffer + *length, 1, capacity - *length, stream)) > 0;) {
+		*length += n;
+		if (*length == capacity) {
+			buffer = reallocate(env, buffer, 2 * capacity, "buffer[]");
+			capacity *= 2;
+		}
+	}
+	return buffer;
+}
+
+// Gets the size of regular file STREAM, or -1 for anything else.
+static long file_size(FILE* stream)
+{
+	if (fseek(stream, 0, SEEK_END) != 0) return -1;
+	const long size = ftell(stream);
+	if (fseek(stream, 0, SEEK_SET) != 0) return -1;
+	return size;
+}
+
+// readFile(path) gets the whole contents of the file at PATH as a string, or nil.
+static bool native_readFile(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_string(argv[0])) return false;
+
+	FILE* stream = fopen(value_as_c_str(argv[0]), "rb");
+	if (stream == NULL) return true;
+
+	// files of known size are read right into the string, which is one copy less than going through a buffer
+	const long size = file_size(stream);
+	if (size >= 0) {
+		ObjString* contents = make_obj_string_buffer(env, (size_t)size);
+		argv[-1] = obj_value((Obj*)contents);
+		const size_t length = fread(contents->chars, 1, contents->length, stream);
+		if (length < contents->length) // it shrank meanwhile
+			argv[-1] = obj_value((Obj*)make_obj_string_uninterned(env, contents->chars, length));
+	} else {
+		size_t length;
+		char* buffer = read_rest(env, stream, FILE_BUFFER_SIZE, &length);
+		argv[-1] = obj_value((Obj*)make_obj_string_uninterned(env, buffer, length));
+		reallocate(env, buffer, 0, "buffer[]");
+	}
+	fclose(stream);
+	return true;
+}
+
+// readLines(path) gets a list with every line in the file at PATH, without their newlines, or nil.
+static bool native_readLines(Environment* env, int argc, Value argv[])
+{
+	if (argc != 1) return false;
+	else if (!value_is_string(argv[0])) return false;
+
+	FILE* stream = fopen(value_as_c_str(argv[0]), "rb");
+	if (stream == NULL) return true;
+	const long size = file_size(stream);
+	size_t length;
+	char* contents = read_rest(env, stream, size >= 0 ? (size_t)size + 1 : FILE_BUFFER_SIZE, &length);
+	fclose(stream);
+
+	// as with split(), lines are counted first so that the list never grows
+	const char* const end = contents + length;
+	size_t count = length > 0 && end[-1] != '\n'; // the last line may lack a newline
+	for (const char* p = contents; (p = memchr(p, '\n', end - p)) != NULL; ++p)
+		++count;
+	if (count > INT32_MAX) {
+		reallocate(env, contents, 0, "buffer[]");
+		return false;
+	}
+
+	ObjList* list = make_obj_list(env);
+	argv[-1] = obj_value((Obj*)list);
+	obj_list_reserve(env, list, (int)count);
+	const char* start = contents;
+	for (size_t i = 0; i < count; ++i) {
+		const char* newline = memchr(start, '\n', end - start);
+		const char* stop = newline != NULL ? newline : end;
+		ObjString* line = make_obj_string_uninterned(env, start, stop - start);
+		list->items[list->count++] = obj_value((Obj*)line);
+		start = stop + 1;
+	}
+	reallocate(env, contents, 0, "buffer[]");
+	return true;
+}
+
+// writeFile(path, data) replaces the file at PATH with the string or bytes in DATA, giving whether it worked.
+static bool native_writeFile(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	const char* data;
+	size_t length;
+	if (!value_is_string(argv[0]) || !data_of(argv[1], &data, &length)) return false;
+
+	FILE* stream = fopen(value_as_c_str(argv[0]), "wb");
+	bool ok = stream != NULL;
+	if (ok) {
+		ok = fwrite(data, 1, length, stream) == length;
+		ok &= fclose(stream) == 0;
+	}
+	argv[-1] = bool_value(ok);
+	return true;
+}
+
+// f64Map(array, f) makes a new array with the result of calling F on each item of ARRAY.
+static bool native_f64Map(Environment* env, int argc, Value argv[])
+{
+	if (argc != 2) return false;
+	else if (!value_is_float64_array(argv[0])) return false;
+
+	const int count = value_as_float64_array(argv[0])->count;
+	argv[-1] = obj_value((Obj*)make_obj_float64_array(env, count));
+	for (int i = 0; i < count; ++i) {
+		// the GC may move both arrays during each call, so they're looked up again
+		const Value item = number_value(value_as_float64_array(argv[0])->items[i]);
+		Value result;
+		if (!call_from_native(env->vm, argv[1], item, &result)) return false;
+		else if (!value_is_number(result)) return false;
+		value_as_float64_array(argv[-1])->items[i] = value_as_number(result);
+	}
 	return true;
 }
 
 void vm_init(VM* vm)
 {
+	assert(sizeof(struct Obj) == 8);
 	vm->data.vm = vm;
 	vm->data.compiler = NULL;
+	output_init(&vm->output, vm->output_buffer, sizeof(vm->output_buffer));
+	vm->kernels = kernels_select();
 
 	reset_stack(vm);
 	vm->data.open_upvalues = NULL;
 	vm->data.allocated = 0;
 	vm->data.next_gc = GC_HEAP_INITIAL;
+	vm->data.compaction_pending = false;
+	vm->data.collecting = false;
 
 	stack_init(&vm->data.grays, 0, sizeof(Obj*), STDLIB_ALLOCATOR);
 	vm->init_string = NULL;
-	vm->data.objects = NULL;
+	memset(vm->bound_methods, 0, sizeof(vm->bound_methods));
+	vm->method_cache = (MethodCache){0};
+	heap_init(&vm->data.heap);
 
 	value_array_init(&vm->data.constants, &vm->data);
 	table_init(&vm->data.strings, &vm->data);
@@ -127,20 +912,63 @@ void vm_init(VM* vm)
 
 	define_native(vm, "clock", native_clock);
 	define_native(vm, "error", native_error);
+	define_native(vm, "flush", native_flush);
 	define_native(vm, "hasField", native_hasField);
 	define_native(vm, "getField", native_getField);
 	define_native(vm, "setField", native_setField);
 	define_native(vm, "deleteField", native_deleteField);
+	define_native(vm, "length", native_length);
+	define_native(vm, "append", native_append);
+	define_native(vm, "listInsert", native_listInsert);
+	define_native(vm, "listRemove", native_listRemove);
+	define_native(vm, "hasKey", native_hasKey);
+	define_native(vm, "deleteKey", native_deleteKey);
+	define_native(vm, "keys", native_keys);
+	define_native(vm, "values", native_values);
+	define_native(vm, "Float64Array", native_Float64Array);
+	define_native(vm, "f64Sum", native_f64Sum);
+	define_native(vm, "f64Dot", native_f64Dot);
+	define_native(vm, "f64Scale", native_f64Scale);
+	define_native(vm, "f64Add", native_f64Add);
+	define_native(vm, "f64Min", native_f64Min);
+	define_native(vm, "f64Max", native_f64Max);
+	define_native(vm, "f64Sort", native_f64Sort);
+	define_native(vm, "f64Map", native_f64Map);
+	define_native(vm, "Bytes", native_Bytes);
+	define_native(vm, "slice", native_slice);
+	define_native(vm, "toString", native_toString);
+	define_native(vm, "toNumber", native_toNumber);
+	define_native(vm, "substring", native_substring);
+	define_native(vm, "indexOf", native_indexOf);
+	define_native(vm, "startsWith", native_startsWith);
+	define_native(vm, "split", native_split);
+	define_native(vm, "join", native_join);
+	define_native(vm, "replace", native_replace);
+	define_native(vm, "toUpper", native_toUpper);
+	define_native(vm, "toLower", native_toLower);
+	define_native(vm, "openFile", native_openFile);
+	define_native(vm, "readLine", native_readLine);
+	define_native(vm, "readChunk", native_readChunk);
+	define_native(vm, "writeChunk", native_writeChunk);
+	define_native(vm, "closeFile", native_closeFile);
+	define_native(vm, "readFile", native_readFile);
+	define_native(vm, "readLines", native_readLines);
+	define_native(vm, "writeFile", native_writeFile);
 }
 
 void vm_destroy(VM* vm)
 {
+	output_flush(&vm->output);
 	table_destroy(&vm->data.globals);
 	table_destroy(&vm->data.strings);
 	value_array_destroy(&vm->data.constants);
 	free_objects(&vm->data);
 	vm->init_string = NULL;
 	stack_destroy(&vm->data.grays);
+
+#if DEBUG_LOG_METHOD_CACHE
+	printf("-- method cache: %zu hits, %zu misses\n", vm->method_cache.hits, vm->method_cache.misses);
+#endif
 }
 
 static void push(VM* vm, Value value)
@@ -168,16 +996,25 @@ static bool value_is_falsey(Value value)
 
 static void concatenate_strings(VM* vm)
 {
-	const ObjString* b = value_as_string(peek(vm, 0));
-	const ObjString* a = value_as_string(peek(vm, 1));
-	ObjString* c = obj_string_concat(&vm->data, a, b);
+	Obj* b = value_as_obj(peek(vm, 0));
+	Obj* a = value_as_obj(peek(vm, 1));
+	Obj* c = obj_string_concat(&vm->data, a, b);
 	pop(vm);
 	pop(vm);
-	push(vm, obj_value((Obj*)c));
+	push(vm, obj_value(c));
+}
+
+// Replaces a rope DISTANCE slots down the stack by the equivalent flat string.
+static void flatten(VM* vm, int distance)
+{
+	Value* slot = &vm->stack_pointer[-1 - distance];
+	if (value_is_rope(*slot))
+		*slot = obj_value((Obj*)obj_rope_flatten(&vm->data, value_as_rope(*slot)));
 }
 
 static void runtime_error(VM* vm, const char* format, ...)
 {
+	output_flush(&vm->output); // so that the error comes after everything printed before it
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -241,11 +1078,16 @@ static bool call_value(VM* vm, Value callee, int argc)
 		case OBJ_CLOSURE:
 			return call(vm, value_as_closure(callee), argc);
 		case OBJ_NATIVE: {
+			// natives only ever see flat strings
+			for (int i = 0; i < argc; ++i)
+				flatten(vm, i);
 			NativeFn native = value_as_native(callee);
 			vm->stack_pointer[- argc - 1] = nil_value();
-			if (native(argc, vm->stack_pointer - argc)) {
+			if (native(&vm->data, argc, vm->stack_pointer - argc)) {
 				vm->stack_pointer -= argc;
 				return true;
+			} else if (vm->frame_count == 0) {
+				// it called back into Lox code, which has already reported an error
 			} else {
 				const Value err = vm->stack_pointer[- argc - 1];
 				if (value_is_string(err))
@@ -284,17 +1126,53 @@ FAIL:
 	return false;
 }
 
-static bool invoke_from_class(VM* vm, ObjClass* class, ObjString* name, int argc)
+static MethodCacheEntry* method_cache_slot(VM* vm, const ObjClass* class, const ObjString* name)
+{
+	const uintptr_t key = (uintptr_t)class ^ ((uintptr_t)name >> 4);
+	return &vm->method_cache.entries[(key >> 4) % METHOD_CACHE_SIZE];
+}
+
+// Forgets every method cached for CLASS, which is about to change.
+static void method_cache_flush(VM* vm, const ObjClass* class)
 {
-	Value method;
-	if (!table_get(&class->methods, name, &method)) {
+	for (int i = 0; i < METHOD_CACHE_SIZE; ++i) {
+		if (vm->method_cache.entries[i].class == class)
+			vm->method_cache.entries[i].class = NULL;
+	}
+}
+
+// Looks up method NAME, with the given SELECTOR, in CLASS. Returns NULL when not found.
+static ObjClosure* find_method(VM* vm, const ObjClass* class, ObjString* name, int selector)
+{
+	ObjClosure* method = obj_class_dispatch(class, selector);
+	if (method != NULL)
+		return method;
+
+	// the method table is authoritative, with the cache in front of it for sparse classes
+	MethodCacheEntry* entry = method_cache_slot(vm, class, name);
+	if (entry->class == class && entry->name == name) {
+		vm->method_cache.hits++;
+		return entry->method;
+	}
+	vm->method_cache.misses++;
+
+	Value value;
+	if (!table_get(&class->methods, name, &value)) return NULL;
+	*entry = (MethodCacheEntry){ .class = class, .name = name, .method = value_as_closure(value) };
+	return entry->method;
+}
+
+static bool invoke_from_class(VM* vm, ObjClass* class, ObjString* name, int selector, int argc)
+{
+	ObjClosure* method = find_method(vm, class, name, selector);
+	if (method == NULL) {
 		runtime_error(vm, "Undefined property '%s'.", name->chars);
 		return false;
 	}
-	return call(vm, value_as_closure(method), argc);
+	return call(vm, method, argc);
 }
 
-static bool invoke(VM* vm, ObjString* name, int argc)
+static bool invoke(VM* vm, ObjString* name, int selector, int argc)
 {
 	const Value receiver = peek(vm, argc);
 	if (!value_is_instance(receiver)) {
@@ -305,12 +1183,12 @@ static bool invoke(VM* vm, ObjString* name, int argc)
 
 	// check if we're invoking a field instead of a method
 	Value value;
-	if (table_get(&instance->fields, name, &value)) {
+	if (obj_instance_get(instance, name, &value)) {
 		vm->stack_pointer[-(argc + 1)] = value;
 		return call_value(vm, value, argc);
 	}
 
-	return invoke_from_class(vm, instance->class, name, argc);
+	return invoke_from_class(vm, obj_instance_class(instance), name, selector, argc);
 }
 
 static ObjUpvalue* capture_upvalue(VM* vm, Value* local)
@@ -348,24 +1226,59 @@ static void close_upvalues(VM* vm, Value* last)
 	}
 }
 
-static void define_method(VM* vm, ObjString* name)
+static void define_method(VM* vm, ObjString* name, int selector)
 {
-	const Value method = peek(vm, 0);
+	ObjClosure* method = value_as_closure(peek(vm, 0));
 	ObjClass* class = value_as_class(peek(vm, 1));
-	table_put(&class->methods, name, method);
+	method_cache_flush(vm, class);
+	obj_class_define(&vm->data, class, name, selector, method);
 	pop(vm);
 }
 
-static bool bind_method(VM* vm, ObjClass* class, ObjString* name)
+static bool bind_method(VM* vm, ObjClass* class, ObjString* name, int selector)
 {
-	Value meth;
-	if (!table_get(&class->methods, name, &meth)) return false;
-	ObjBoundMethod* bound = make_obj_method(&vm->data, peek(vm, 0), value_as_closure(meth));
+	ObjClosure* method = find_method(vm, class, name, selector);
+	if (method == NULL) return false;
+
+	// rebinding the same method to the same receiver reuses a recent bound method
+	const Value receiver = peek(vm, 0);
+	const uintptr_t key = (uintptr_t)value_as_obj(receiver) ^ (uintptr_t)method;
+	ObjBoundMethod** cached = &vm->bound_methods[(key >> 4) % BOUND_METHOD_CACHE];
+	ObjBoundMethod* bound = *cached;
+	if (bound == NULL || bound->method != method
+	    || value_as_obj(bound->receiver) != value_as_obj(receiver)) {
+		bound = make_obj_method(&vm->data, receiver, method);
+		*cached = bound;
+	}
 	pop(vm);
 	push(vm, obj_value((Obj*)bound));
 	return true;
 }
 
+/* Replaces the two ints on top of the stack with RESULT, which came from an
+arithmetic operation on them, unless doubles would've given something else: when
+it doesn't fit an int32_t, or when it's zero and could have been -0 (0 * -1). */
+static bool int_result(VM* vm, int64_t result)
+{
+	if (result < INT32_MIN || result > INT32_MAX)
+		return false;
+	else if (result == 0 && (value_as_int(peek(vm, 0)) < 0 || value_as_int(peek(vm, 1)) < 0))
+		return false;
+
+	vm->stack_pointer--;
+	vm->stack_pointer[-1] = int_value((int32_t)result);
+	return true;
+}
+
+// Backward jumps and returns are safe points, where all object pointers are GC roots.
+static void safe_point(VM* vm)
+{
+#if GC_COMPACTION
+	if (vm->data.compaction_pending)
+		compact_garbage(&vm->data);
+#endif
+}
+
 static void debug_trace_run(const VM* vm, const CallFrame* frame)
 {
 #if DEBUG_TRACE_EXECUTION
@@ -382,13 +1295,59 @@ static void debug_trace_run(const VM* vm, const CallFrame* frame)
 #endif
 }
 
-static void inherit_each_method(const ObjString* name, Value* method, void* class_ptr)
+/* Where the parts of a string interpolation get written: just counted while
+DEST is NULL, and copied there after LENGTH bytes otherwise. */
+typedef struct {
+	char* dest;
+	size_t length;
+} PartSink;
+
+static void write_part_data(void* sink_ptr, const char* data, size_t length)
+{
+	PartSink* sink = (PartSink*)sink_ptr;
+	if (sink->dest != NULL)
+		memcpy(sink->dest + sink->length, data, length);
+	sink->length += length;
+}
+
+/* Writes the COUNT values on top of the stack to SINK, strings as their contents
+and everything else as it would be printed. */
+static void write_parts(VM* vm, int count, PartSink* sink)
 {
-	ObjClass* class = (ObjClass*)class_ptr;
-	table_put(&class->methods, name, *method);
+	char buffer[256];
+	Output out;
+	output_init(&out, buffer, sizeof(buffer));
+	output_set_sink(&out, write_part_data, sink);
+	for (int i = count - 1; i >= 0; --i) {
+		const Value part = peek(vm, i);
+		if (value_is_string(part))
+			output_write(&out, value_as_c_str(part), value_as_string(part)->length);
+		else
+			value_write(part, &out);
+	}
+	output_flush(&out);
 }
 
-static InterpretResult run(VM* vm)
+// Replaces the COUNT values on top of the stack with a single string joining all of them.
+static void build_string(VM* vm, int count)
+{
+	for (int i = 0; i < count; ++i)
+		flatten(vm, i);
+
+	// the parts get written twice, so that the result can be sized beforehand
+	PartSink sink = { .dest = NULL, .length = 0 };
+	write_parts(vm, count, &sink);
+	ObjString* result = make_obj_string_buffer(&vm->data, sink.length);
+	sink = (PartSink){ .dest = result->chars, .length = 0 };
+	write_parts(vm, count, &sink);
+
+	vm->stack_pointer -= count;
+	push(vm, obj_value((Obj*)result));
+}
+
+/* Runs the VM until the frame count goes back down to BASE, leaving the value
+returned by the last frame on top of the stack. */
+static InterpretResult run(VM* vm, int base)
 {
 	CallFrame* frame = &vm->frames[vm->frame_count - 1];
 
@@ -400,6 +1359,8 @@ static InterpretResult run(VM* vm)
 		| chunk_get_byte(&frame->subroutine->function->bytecode, frame->program_counter - 1))
 	#define READ_CONSTANT() constant_get(&vm->data.constants, READ_BYTE())
 	#define READ_STRING() value_as_string(READ_CONSTANT())
+	#define SELECTOR_NAME(selector) \
+		value_as_string(constant_get(&vm->data.constants, (selector)))
 	#define BINARY_OP(type_value, op) do { \
 		if (!value_is_number(peek(vm, 0)) || !value_is_number(peek(vm, 1))) { \
 			runtime_error(vm, "Operands must be numbers."); \
@@ -410,6 +1371,23 @@ static InterpretResult run(VM* vm)
 		push(vm, type_value(a op b)); \
 	} while (0)
 
+	// integers take a fast path, as long as it gives the same result as doubles
+	#define ARITHMETIC_OP(op) do { \
+		if (!value_is_int(peek(vm, 0)) || !value_is_int(peek(vm, 1)) \
+		    || !int_result(vm, (int64_t)value_as_int(peek(vm, 1)) op value_as_int(peek(vm, 0)))) \
+			BINARY_OP(number_value, op); \
+	} while (0)
+
+	#define COMPARISON_OP(op) do { \
+		if (value_is_int(peek(vm, 0)) && value_is_int(peek(vm, 1))) { \
+			const bool result = value_as_int(peek(vm, 1)) op value_as_int(peek(vm, 0)); \
+			vm->stack_pointer--; \
+			vm->stack_pointer[-1] = bool_value(result); \
+		} else { \
+			BINARY_OP(bool_value, op); \
+		} \
+	} while (0)
+
 #if COMPUTED_GOTO
 
 	static void* jump_table[] = {
@@ -427,7 +1405,13 @@ static InterpretResult run(VM* vm)
 		[OP_SET_UPVALUE]   = &&OP_SET_UPVALUE_LABEL,
 		[OP_GET_PROPERTY]  = &&OP_GET_PROPERTY_LABEL,
 		[OP_SET_PROPERTY]  = &&OP_SET_PROPERTY_LABEL,
+		[OP_GET_METHOD]    = &&OP_GET_METHOD_LABEL,
 		[OP_GET_SUPER]     = &&OP_GET_SUPER_LABEL,
+		[OP_BUILD_LIST]    = &&OP_BUILD_LIST_LABEL,
+		[OP_BUILD_MAP]     = &&OP_BUILD_MAP_LABEL,
+		[OP_BUILD_STRING]  = &&OP_BUILD_STRING_LABEL,
+		[OP_GET_INDEX]     = &&OP_GET_INDEX_LABEL,
+		[OP_SET_INDEX]     = &&OP_SET_INDEX_LABEL,
 		[OP_EQUAL]         = &&OP_EQUAL_LABEL,
 		[OP_GREATER]       = &&OP_GREATER_LABEL,
 		[OP_LESS]          = &&OP_LESS_LABEL,
@@ -444,6 +1428,7 @@ static InterpretResult run(VM* vm)
 		[OP_CALL]          = &&OP_CALL_LABEL,
 		[OP_INVOKE]        = &&OP_INVOKE_LABEL,
 		[OP_SUPER_INVOKE]  = &&OP_SUPER_INVOKE_LABEL,
+		[OP_CALL_METHOD]   = &&OP_CALL_METHOD_LABEL,
 		[OP_CLOSURE]       = &&OP_CLOSURE_LABEL,
 		[OP_CLOSE_UPVALUE] = &&OP_CLOSE_UPVALUE_LABEL,
 		[OP_RETURN]        = &&OP_RETURN_LABEL,
@@ -560,13 +1545,14 @@ static InterpretResult run(VM* vm)
 				}
 
 				const ObjInstance* instance = value_as_instance(peek(vm, 0));
-				ObjString* name = READ_STRING();
+				const uint8_t selector = READ_BYTE();
+				ObjString* name = SELECTOR_NAME(selector);
 
 				Value value;
-				if (table_get(&instance->fields, name, &value)) {
+				if (obj_instance_get(instance, name, &value)) {
 					pop(vm);
 					push(vm, value);
-				} else if (!bind_method(vm, instance->class, name)) {
+				} else if (!bind_method(vm, obj_instance_class(instance), name, selector)) {
 					runtime_error(vm, "Undefined property '%s'.", name->chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
@@ -581,7 +1567,7 @@ static InterpretResult run(VM* vm)
 
 				ObjInstance* instance = value_as_instance(peek(vm, 1));
 				ObjString* name = READ_STRING();
-				table_put(&instance->fields, name, peek(vm, 0));
+				obj_instance_set(&vm->data, instance, name, peek(vm, 0));
 
 				Value value = pop(vm);
 				pop(vm);
@@ -589,14 +1575,195 @@ static InterpretResult run(VM* vm)
 				BREAK();
 			}
 
+			CASE(OP_GET_METHOD): {
+				// like OP_GET_PROPERTY, but leaves the receiver for OP_CALL_METHOD
+				if (!value_is_instance(peek(vm, 0))) {
+					runtime_error(vm, "Only instances have properties.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				const ObjInstance* instance = value_as_instance(peek(vm, 0));
+				const uint8_t selector = READ_BYTE();
+				ObjString* name = SELECTOR_NAME(selector);
+
+				// fields replace the receiver and get a nil marker instead of a method
+				Value value;
+				if (obj_instance_get(instance, name, &value)) {
+					vm->stack_pointer[-1] = value;
+					push(vm, nil_value());
+				} else {
+					ObjClosure* method = find_method(vm, obj_instance_class(instance), name, selector);
+					if (method == NULL) {
+						runtime_error(vm, "Undefined property '%s'.", name->chars);
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					push(vm, obj_value((Obj*)method));
+				}
+				BREAK();
+			}
+
 			CASE(OP_GET_SUPER): {
-				ObjString* name = READ_STRING();
+				const uint8_t selector = READ_BYTE();
 				ObjClass* super = value_as_class(pop(vm));
-				if (!bind_method(vm, super, name)) return INTERPRET_RUNTIME_ERROR;
+				if (!bind_method(vm, super, SELECTOR_NAME(selector), selector))
+					return INTERPRET_RUNTIME_ERROR;
+				BREAK();
+			}
+
+			CASE(OP_BUILD_LIST): {
+				const int count = READ_BYTE();
+				ObjList* list = make_obj_list(&vm->data);
+				push(vm, obj_value((Obj*)list));
+				obj_list_reserve(&vm->data, list, count);
+
+				const Value* items = vm->stack_pointer - 1 - count;
+				for (int i = 0; i < count; ++i)
+					list->items[i] = items[i];
+				list->count = count;
+
+				vm->stack_pointer -= count + 1;
+				push(vm, obj_value((Obj*)list));
+				BREAK();
+			}
+
+			CASE(OP_BUILD_MAP): {
+				const int count = READ_BYTE();
+				ObjMap* map = make_obj_map(&vm->data);
+				push(vm, obj_value((Obj*)map));
+
+				// keys are flattened in place, so that they stay reachable
+				for (int i = 0; i < count; ++i) {
+					flatten(vm, 2 * (count - i));
+					const Value* entry = vm->stack_pointer - 1 - 2 * (count - i);
+					value_map_put(&map->map, entry[0], entry[1]);
+				}
+
+				vm->stack_pointer -= 2 * count + 1;
+				push(vm, obj_value((Obj*)map));
+				BREAK();
+			}
+
+			CASE(OP_BUILD_STRING): {
+				const int count = READ_BYTE();
+				build_string(vm, count);
+				BREAK();
+			}
+
+			CASE(OP_GET_INDEX): {
+				if (value_is_map(peek(vm, 1))) {
+					flatten(vm, 0);
+					Value value;
+					if (!value_map_get(&value_as_map(peek(vm, 1))->map, peek(vm, 0), &value))
+						value = nil_value();
+					vm->stack_pointer--;
+					vm->stack_pointer[-1] = value;
+					BREAK();
+				} else if (value_is_float64_array(peek(vm, 1))) {
+					const ObjFloat64Array* array = value_as_float64_array(peek(vm, 1));
+					const int index = index_of(peek(vm, 0), array->count);
+					if (index < 0) {
+						runtime_error(vm, "Array index out of range.");
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					vm->stack_pointer--;
+					vm->stack_pointer[-1] = number_value(array->items[index]);
+					BREAK();
+				} else if (value_is_bytes(peek(vm, 1))) {
+					const ObjBytes* bytes = value_as_bytes(peek(vm, 1));
+					const int index = index_of(peek(vm, 0), bytes->length);
+					if (index < 0) {
+						runtime_error(vm, "Bytes index out of range.");
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					vm->stack_pointer--;
+					vm->stack_pointer[-1] = int_value(obj_bytes_data(bytes)[index]);
+					BREAK();
+				} else if (!value_is_list(peek(vm, 1))) {
+					runtime_error(vm, "Only lists, maps, arrays and bytes can be indexed.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				const ObjList* list = value_as_list(peek(vm, 1));
+				const int index = index_of(peek(vm, 0), list->count);
+				if (index < 0) {
+					runtime_error(vm, "List index out of range.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				vm->stack_pointer--;
+				vm->stack_pointer[-1] = list->items[index];
+				BREAK();
+			}
+
+			CASE(OP_SET_INDEX): {
+				if (value_is_map(peek(vm, 2))) {
+					flatten(vm, 1);
+					value_map_put(&value_as_map(peek(vm, 2))->map, peek(vm, 1), peek(vm, 0));
+					const Value value = pop(vm);
+					vm->stack_pointer -= 2;
+					push(vm, value);
+					BREAK();
+				} else if (value_is_float64_array(peek(vm, 2))) {
+					ObjFloat64Array* array = value_as_float64_array(peek(vm, 2));
+					const int index = index_of(peek(vm, 1), array->count);
+					if (index < 0) {
+						runtime_error(vm, "Array index out of range.");
+						return INTERPRET_RUNTIME_ERROR;
+					} else if (!value_is_number(peek(vm, 0))) {
+						runtime_error(vm, "Array items must be numbers.");
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					const Value value = pop(vm);
+					array->items[index] = value_as_number(value);
+					vm->stack_pointer -= 2;
+					push(vm, value);
+					BREAK();
+				} else if (value_is_bytes(peek(vm, 2))) {
+					const ObjBytes* bytes = value_as_bytes(peek(vm, 2));
+					const int index = index_of(peek(vm, 1), bytes->length);
+					const int byte = index_of(peek(vm, 0), 256);
+					if (index < 0) {
+						runtime_error(vm, "Bytes index out of range.");
+						return INTERPRET_RUNTIME_ERROR;
+					} else if (byte < 0) {
+						runtime_error(vm, "Bytes can only hold integers from 0 to 255.");
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					obj_bytes_data(bytes)[index] = (uint8_t)byte;
+					const Value value = pop(vm);
+					vm->stack_pointer -= 2;
+					push(vm, value);
+					BREAK();
+				} else if (!value_is_list(peek(vm, 2))) {
+					runtime_error(vm, "Only lists, maps, arrays and bytes can be indexed.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				ObjList* list = value_as_list(peek(vm, 2));
+				const int index = index_of(peek(vm, 1), list->count);
+				if (index < 0) {
+					runtime_error(vm, "List index out of range.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				const Value value = pop(vm);
+				list->items[index] = value;
+				vm->stack_pointer -= 2;
+				push(vm, value);
 				BREAK();
 			}
 
 			CASE(OP_EQUAL): {
+				if (value_is_int(peek(vm, 0)) && value_is_int(peek(vm, 1))) {
+					const bool equal = value_as_int(peek(vm, 0)) == value_as_int(peek(vm, 1));
+					vm->stack_pointer--;
+					vm->stack_pointer[-1] = bool_value(equal);
+					BREAK();
+				}
+
+				// ropes get flattened so that their contents can be compared
+				flatten(vm, 0);
+				flatten(vm, 1);
 				const Value b = pop(vm);
 				const Value a = pop(vm);
 				push(vm, bool_value(value_equal(a, b)));
@@ -604,30 +1771,30 @@ static InterpretResult run(VM* vm)
 			}
 
 			CASE(OP_GREATER):
-				BINARY_OP(bool_value, >);
+				COMPARISON_OP(>);
 				BREAK();
 
 			CASE(OP_LESS):
-				BINARY_OP(bool_value, <);
+				COMPARISON_OP(<);
 				BREAK();
 
 			CASE(OP_ADD):
-				if (value_is_string(peek(vm, 0)) && value_is_string(peek(vm, 1))) {
+				if (value_is_string_or_rope(peek(vm, 0)) && value_is_string_or_rope(peek(vm, 1))) {
 					concatenate_strings(vm);
 				} else if (!value_is_number(peek(vm, 0)) || !value_is_number(peek(vm, 1))) {
 					runtime_error(vm, "Operands must be two numbers or two strings.");
 					return INTERPRET_RUNTIME_ERROR;
 				} else {
-					BINARY_OP(number_value, +);
+					ARITHMETIC_OP(+);
 				}
 				BREAK();
 
 			CASE(OP_SUBTRACT):
-				BINARY_OP(number_value, -);
+				ARITHMETIC_OP(-);
 				BREAK();
 
 			CASE(OP_MULTIPLY):
-				BINARY_OP(number_value, *);
+				ARITHMETIC_OP(*);
 				BREAK();
 
 			CASE(OP_DIVIDE):
@@ -643,12 +1810,18 @@ static InterpretResult run(VM* vm)
 					runtime_error(vm, "Operand must be a number.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				push(vm, number_value(-value_as_number(pop(vm))));
+				if (value_is_int(peek(vm, 0)) && value_as_int(peek(vm, 0)) != 0
+				    && value_as_int(peek(vm, 0)) != INT32_MIN) { // -0 and 2^31 are doubles
+					vm->stack_pointer[-1] = int_value(-value_as_int(peek(vm, 0)));
+				} else {
+					push(vm, number_value(-value_as_number(pop(vm))));
+				}
 				BREAK();
 
 			CASE(OP_PRINT):
-				value_print(pop(vm));
-				printf("\n");
+				flatten(vm, 0);
+				value_write(pop(vm), &vm->output);
+				output_char(&vm->output, '\n');
 				BREAK();
 
 			CASE(OP_JUMP): {
@@ -667,6 +1840,7 @@ static InterpretResult run(VM* vm)
 			CASE(OP_LOOP): {
 				const uint16_t jump = READ_SHORT();
 				frame->program_counter -= jump;
+				safe_point(vm);
 				BREAK();
 			}
 
@@ -681,9 +1855,9 @@ static InterpretResult run(VM* vm)
 			}
 
 			CASE(OP_INVOKE): {
-				ObjString* method = READ_STRING();
+				const uint8_t selector = READ_BYTE();
 				const int argc = READ_BYTE();
-				if (!invoke(vm, method, argc)) {
+				if (!invoke(vm, SELECTOR_NAME(selector), selector, argc)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm->frames[vm->frame_count - 1];
@@ -691,10 +1865,27 @@ static InterpretResult run(VM* vm)
 			}
 
 			CASE(OP_SUPER_INVOKE): {
-				ObjString* method = READ_STRING();
+				const uint8_t selector = READ_BYTE();
 				const int argc = READ_BYTE();
 				ObjClass* super = value_as_class(pop(vm));
-				if (!invoke_from_class(vm, super, method, argc)) {
+				if (!invoke_from_class(vm, super, SELECTOR_NAME(selector), selector, argc)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm->frames[vm->frame_count - 1];
+				BREAK();
+			}
+
+			CASE(OP_CALL_METHOD): {
+				// the method (or marker) left by OP_GET_METHOD is dropped from below the arguments
+				const int argc = READ_BYTE();
+				Value* slot = vm->stack_pointer - (argc + 1);
+				const Value method = *slot;
+				memmove(slot, slot + 1, argc * sizeof(Value));
+				vm->stack_pointer--;
+
+				const bool ok = value_is_nil(method) ? call_value(vm, peek(vm, argc), argc)
+				                                     : call(vm, value_as_closure(method), argc);
+				if (!ok) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm->frames[vm->frame_count - 1];
@@ -705,7 +1896,7 @@ static InterpretResult run(VM* vm)
 				ObjFunction* function = value_as_function(READ_CONSTANT());
 				ObjClosure* closure = make_obj_closure(&vm->data, function);
 				push(vm, obj_value((Obj*)closure));
-				for (int i = 0; i < closure->upvalue_count; ++i) {
+				for (int i = 0; i < function->upvalues; ++i) {
 					const uint8_t local = READ_BYTE();
 					const uint8_t index = READ_BYTE();
 					closure->upvalues[i] = local ? capture_upvalue(vm, frame->frame_pointer + index)
@@ -725,15 +1916,13 @@ static InterpretResult run(VM* vm)
 				close_upvalues(vm, frame->frame_pointer);
 
 				vm->frame_count--;
-				if (vm->frame_count <= 0) {
-					pop(vm);
-					return INTERPRET_OK;
-				}
-
 				vm->stack_pointer = frame->frame_pointer;
 				push(vm, result);
+				if (vm->frame_count <= base)
+					return INTERPRET_OK;
 
 				frame = &vm->frames[vm->frame_count - 1];
+				safe_point(vm);
 				BREAK();
 			}
 
@@ -752,15 +1941,18 @@ static InterpretResult run(VM* vm)
 				}
 				const ObjClass* superclass = value_as_class(super);
 				ObjClass* class = value_as_class(peek(vm, 0));
-				table_for_each(&superclass->methods, inherit_each_method, class);
+				method_cache_flush(vm, class);
+				obj_class_inherit(&vm->data, class, superclass);
 				pop(vm); // subclass
 				// no need to pop super as it is on a separate scope
 				BREAK();
 			}
 
-			CASE(OP_METHOD):
-				define_method(vm, READ_STRING());
+			CASE(OP_METHOD): {
+				const uint8_t selector = READ_BYTE();
+				define_method(vm, SELECTOR_NAME(selector), selector);
 				BREAK();
+			}
 
 	#if !(COMPUTED_GOTO)
 			default:
@@ -773,7 +1965,10 @@ static InterpretResult run(VM* vm)
 	#undef BREAK
 	#undef CASE
 	#undef DISPATCH
+	#undef COMPARISON_OP
+	#undef ARITHMETIC_OP
 	#undef BINARY_OP
+	#undef SELECTOR_NAME
 	#undef READ_STRING
 	#undef READ_CONSTANT
 	#undef READ_SHORT
@@ -792,5 +1987,30 @@ InterpretResult vm_interpret(VM* vm, const char* source)
 	push(vm, obj_value((Obj*)program));
 	call(vm, program, 0);
 
-	return run(vm);
+	const InterpretResult result = run(vm, 0);
+	if (result == INTERPRET_OK) pop(vm);
+	output_flush(&vm->output);
+	return result;
+}
+
+void vm_set_output(VM* vm, OutputSink sink, void* context)
+{
+	output_set_sink(&vm->output, sink, context);
+}
+
+/* Calls CALLEE with a single ARG from inside a native, running it to completion
+before putting its return value in RESULT. Returns false on runtime errors, which
+have already been reported (and have reset the VM) by then. */
+static bool call_from_native(VM* vm, Value callee, Value arg, Value* result)
+{
+	const int base = vm->frame_count;
+	push(vm, callee);
+	push(vm, arg);
+	if (!call_value(vm, callee, 1))
+		return false;
+	else if (vm->frame_count > base && run(vm, base) != INTERPRET_OK)
+		return false;
+
+	*result = pop(vm);
+	return true;
 }
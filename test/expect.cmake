@@ -0,0 +1,40 @@
+# Runs the script SCRIPT with the interpreter LOX, and checks that it prints
+# what the "// => " comments in it say, one line for each. A script expected to
+# stop with a runtime error says so in an "// error: " comment with its message.
+
+file(READ "${SCRIPT}" source)
+
+set(expected "")
+set(rest "${source}")
+string(FIND "${rest}" "// => " at)
+while(NOT at EQUAL -1)
+	math(EXPR at "${at} + 6")
+	string(SUBSTRING "${rest}" ${at} -1 rest)
+	string(FIND "${rest}" "\n" end)
+	string(SUBSTRING "${rest}" 0 ${end} line)
+	set(expected "${expected}${line}\n")
+	string(FIND "${rest}" "// => " at)
+endwhile()
+
+get_filename_component(directory "${SCRIPT}" DIRECTORY)
+execute_process(
+	COMMAND "${LOX}" "${SCRIPT}"
+	WORKING_DIRECTORY "${directory}"
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE errors
+	RESULT_VARIABLE status
+)
+
+if(NOT output STREQUAL expected)
+	message(FATAL_ERROR "Expected output:\n${expected}\nActual output:\n${output}\n${errors}")
+endif()
+
+string(REGEX MATCH "// error: ([^\n]*)" error "${source}")
+if(error)
+	string(FIND "${errors}" "${CMAKE_MATCH_1}" found)
+	if(NOT status EQUAL 70 OR found EQUAL -1)
+		message(FATAL_ERROR "Expected runtime error: ${CMAKE_MATCH_1}\nExit status ${status}:\n${errors}")
+	endif()
+elseif(NOT status EQUAL 0)
+	message(FATAL_ERROR "Exit status ${status}:\n${errors}")
+endif()